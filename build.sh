@@ -1,8 +1,15 @@
 #!/usr/bin/env bash
+#
+# Usage: build.sh [fonograf] [fonograf-train] [bench] [mkdataset] [check]
+#
+# Builds every target by default. fonograf-train is the headless trainer,
+# bench the kernel microbenchmarks and mkdataset writes synthetic IDX
+# files, none of them need X11 or ALSA. check builds the last two and
+# trains on synthetic data to compare the threading modes.
 
 set -e
 
-CC="$(which clang)"
+CC="${CC:-$(which clang)}"
 
 CFLAGS=(
   -std=gnu11 # For MAP_ANONYMOUS and asm
@@ -12,24 +19,22 @@ CFLAGS=(
   -msse4.1
   -ffast-math
   -O3
-  $(pkg-config --cflags alsa)
-  $(pkg-config --cflags x11)
-  $(pkg-config --cflags xrandr)
   -Wno-gnu-alignof-expression
 )
 
 LDFLAGS=(
-  $(pkg-config --libs alsa)
-  $(pkg-config --libs x11)
-  $(pkg-config --libs xrandr)
   -lm
   -pthread
 )
 
 DEFINES=(
   -DDEBUG_MODE=1
+  -DPROFILE_MODE=1
 )
 
+TARGETS=("$@")
+test ${#TARGETS[@]} -gt 0 || TARGETS=(fonograf fonograf-train bench mkdataset)
+
 ROOT_DIR="$(cd $(dirname "$0") && pwd)"
 SRC_DIR="$ROOT_DIR"/src
 BUILD_DIR="$ROOT_DIR"/build
@@ -39,8 +44,75 @@ test -d "$BUILD_DIR" || mkdir -p "$BUILD_DIR"
 
 pushd "$SRC_DIR" > /dev/null
 
-set -x
-"$CC" "${CFLAGS[@]}" "${DEFINES[@]}" linux/main.c -o "$BUILD_DIR"/fonograf "${LDFLAGS[@]}"
-set +x
+for TARGET in "${TARGETS[@]}"
+do
+  case "$TARGET" in
+    fonograf)
+      APP_CFLAGS=(
+        $(pkg-config --cflags alsa)
+        $(pkg-config --cflags x11)
+        $(pkg-config --cflags xext)
+        $(pkg-config --cflags xrandr)
+      )
+      APP_LDFLAGS=(
+        $(pkg-config --libs alsa)
+        $(pkg-config --libs x11)
+        $(pkg-config --libs xext)
+        $(pkg-config --libs xrandr)
+      )
+      set -x
+      "$CC" "${CFLAGS[@]}" "${APP_CFLAGS[@]}" "${DEFINES[@]}" linux/main.c -o "$BUILD_DIR"/fonograf "${APP_LDFLAGS[@]}" "${LDFLAGS[@]}"
+      set +x
+      ;;
+    fonograf-train)
+      set -x
+      "$CC" "${CFLAGS[@]}" "${DEFINES[@]}" linux/train.c -o "$BUILD_DIR"/fonograf-train "${LDFLAGS[@]}"
+      set +x
+      ;;
+    bench)
+      set -x
+      "$CC" "${CFLAGS[@]}" "${DEFINES[@]}" linux/bench.c -o "$BUILD_DIR"/bench "${LDFLAGS[@]}"
+      set +x
+      ;;
+    mkdataset)
+      set -x
+      "$CC" "${CFLAGS[@]}" "${DEFINES[@]}" linux/mkdataset.c -o "$BUILD_DIR"/mkdataset "${LDFLAGS[@]}"
+      set +x
+      ;;
+    check)
+      "$ROOT_DIR"/build.sh fonograf-train mkdataset
+      IMAGES="$BUILD_DIR"/check-images-idx3-ubyte
+      LABELS="$BUILD_DIR"/check-labels-idx1-ubyte
+      "$BUILD_DIR"/mkdataset --images="$IMAGES" --labels="$LABELS" --count=600
+      # Seeded split layers must match the plain path exactly, also with
+      # layer heights that are not a multiple of the SIMD width and with
+      # dropout masks drawn slice by slice
+      for SIZES in 784,20,4096,10 784,65,10 784,13,7,10 784,256,10
+      do
+        for DROPOUT in 0.0 0.5
+        do
+          ARGS=(--images="$IMAGES" --labels="$LABELS" --sizes="$SIZES"
+                --dropout="$DROPOUT" --threads=4 --epochs=2 --seed=5)
+          PLAIN=$("$BUILD_DIR"/fonograf-train "${ARGS[@]}" | tail -n 1)
+          SPLIT=$("$BUILD_DIR"/fonograf-train "${ARGS[@]}" \
+                    --split_layers=true | tail -n 1)
+          PLAIN_COST=$(echo "$PLAIN" | sed -n 's/.*"cost": \([^,]*\),.*/\1/p')
+          SPLIT_COST=$(echo "$SPLIT" | sed -n 's/.*"cost": \([^,]*\),.*/\1/p')
+          if [ -z "$PLAIN_COST" ] || [ "$PLAIN_COST" != "$SPLIT_COST" ]
+          then
+            echo "check: split layers $SIZES dropout $DROPOUT" \
+                 "cost $SPLIT_COST, plain $PLAIN_COST" >&2
+            exit 1
+          fi
+          echo "check: split layers $SIZES dropout $DROPOUT ok"
+        done
+      done
+      ;;
+    *)
+      echo "Unknown target: $TARGET" >&2
+      exit 1
+      ;;
+  esac
+done
 
 popd > /dev/null
@@ -1,109 +1,236 @@
 #include "memory.h"
 #include "maths.h"
 #include "network.h"
+#include "training.h"
 
+#include <limits.h>
 #include <stdio.h>
 
+#define APP_PANEL_WIDTH 300 // @Hardcode
+#define APP_MAX_HEATMAPS 16 // @Hardcode, layers past this are not drawn
+
 static Network *app_network;
 static WorkQueue *app_work_queue;
+static AppConfig app_config;
+static Telemetry app_telemetry;
+static TelemetrySnapshot app_snapshot; // Last one read without a race
+static struct nk_image app_heatmaps[APP_MAX_HEATMAPS];
+static WeightSnapshot *app_heatmap_snapshot; // Rasterized into the heatmaps
+static u32 app_heatmap_step;
 
-static u32
-fread_u32 (FILE *f)
+void
+do_training_work (void *user_data)
 {
-  u32 result;
-  size_t nread;
-  nread = fread (&result, sizeof (result), 1, f);
-  if (nread != 1)
-    return (u32) -1;
-  result = (((result & 0x000000FF) << 24) |
-            ((result & 0x0000FF00) <<  8) |
-            ((result & 0x00FF0000) >>  8) |
-            ((result & 0xFF000000) >> 24));
-  return result;
+  (void) user_data;
+
+  u32 count;
+  float *data = load_training_data (&app_network->mpool, &app_config,
+                                    &count);
+  run_training (app_network, &app_config, data, count);
 }
 
 void
-do_training_work (void *user_data)
+app_init (int argc, char **argv)
 {
-  (void) user_data;
+  app_config = default_app_config ();
+  if (!parse_config_args (&app_config, argc, argv))
+    {
+      print_config_usage (stderr, argv[0]);
+      exit (EXIT_FAILURE);
+    }
+  if (app_config.counters && !enable_profile_counters ())
+    fprintf (stderr, "counters: perf_event_open is not available\n");
+
+  app_network = create_configured_network (&app_config);
+  network_enable_telemetry (app_network, &app_telemetry);
+  network_enable_weight_snapshots (app_network);
+  app_work_queue = create_work_queue (2, 1);
+
+  enqueue_work (app_work_queue, do_training_work, NULL);
+}
+
+void
+app_shutdown ()
+{
+  destroy_work_queue (app_work_queue);
+  destroy_network (app_network);
+  for (u32 i = 0; i < APP_MAX_HEATMAPS; ++i)
+    nk_xsurf_image_free (&app_heatmaps[i]);
+  if (app_config.profile || app_config.counters)
+    print_profile (stderr);
+}
+
+static void
+update_chart (struct nk_context *ctx, const char *title, float *values,
+              u32 nvalues)
+{
+  float min = FLT_MAX;
+  float max = -FLT_MAX;
+  for (u32 i = 0; i < nvalues; ++i)
+    {
+      min = MIN (min, values[i]);
+      max = MAX (max, values[i]);
+    }
+  if (max - min < 1e-6f)
+    max = min + 1e-6f;
+
+  char text[64];
+  snprintf (text, sizeof (text), "%s %.4f", title, values[nvalues - 1]);
+  nk_layout_row_dynamic (ctx, 20, 1);
+  nk_label (ctx, text, NK_TEXT_LEFT);
+  nk_layout_row_dynamic (ctx, 80, 1);
+  if (nk_chart_begin (ctx, NK_CHART_LINES, (int) nvalues, min, max))
+    {
+      for (u32 i = 0; i < nvalues; ++i)
+        nk_chart_push (ctx, values[i]);
+      nk_chart_end (ctx);
+    }
+}
+
+static void
+update_telemetry_panel (struct nk_context *ctx, struct nk_rect bounds)
+{
+  read_telemetry (&app_telemetry, &app_snapshot);
+  TelemetrySnapshot *snapshot = &app_snapshot;
+  char text[128];
 
-  FILE *images_fh = fopen ("data/train-images-idx3-ubyte", "r");
-  FILE *labels_fh = fopen ("data/train-labels-idx1-ubyte", "r");
-  assert (images_fh);
-  assert (labels_fh);
-
-  u32 magic;
-  magic = fread_u32 (images_fh);
-  assert (magic == 2051);
-  magic = fread_u32 (labels_fh);
-  assert (magic == 2049);
-
-  u32 num_images = fread_u32 (images_fh);
-  u32 num_rows = fread_u32 (images_fh);
-  u32 num_cols = fread_u32 (images_fh);
-  u32 num_labels = fread_u32 (labels_fh);
-  printf ("num_images: %u\n", num_images);
-  printf ("num_rows: %u\n", num_rows);
-  printf ("num_cols: %u\n", num_cols);
-  printf ("num_labels: %u\n", num_labels);
-
-  assert (num_labels == num_images);
-
-  /* srand (time (NULL)); */
-
-  u32 images_buffer_size = ((num_rows * num_cols) + 10) * num_images; // +10 for labels
-  float *images_buffer = push_array (&app_network->mpool, float, images_buffer_size,
-                                     MEMORY_FLAG_NONE);
-  for (u32 i = 0, j = 0; i < num_images; ++i)
+  if (nk_begin (ctx, "Training", bounds, NK_WINDOW_TITLE))
     {
-      size_t nread;
-      u8 buffer[num_cols * num_rows];
-      nread = fread (buffer, sizeof (buffer[0]), num_cols * num_rows, images_fh);
-      if (nread != sizeof (buffer[0]) * num_cols * num_rows)
+      nk_layout_row_dynamic (ctx, 20, 1);
+      snprintf (text, sizeof (text), "epoch %u / %u%s",
+                MIN (snapshot->epoch + 1, snapshot->epochs), snapshot->epochs,
+                snapshot->done ? ", done" : "");
+      nk_label (ctx, text, NK_TEXT_LEFT);
+      nk_prog (ctx, snapshot->epoch_samples,
+               MAX (snapshot->epoch_sample_count, 1u), nk_false);
+      snprintf (text, sizeof (text), "%.0f samples/s, eta %.4f",
+                snapshot->samples_per_second, snapshot->eta);
+      nk_label (ctx, text, NK_TEXT_LEFT);
+      snprintf (text, sizeof (text), "pool %.1f of %.1f MiB",
+                snapshot->pool_used / (1024. * 1024.),
+                snapshot->pool_size / (1024. * 1024.));
+      nk_label (ctx, text, NK_TEXT_LEFT);
+
+      float total_seconds = 0.f;
+      for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+        total_seconds += snapshot->phase_seconds[p];
+#if PROFILE_MODE
+      nk_label (ctx, "time per phase, all threads", NK_TEXT_LEFT);
+#else
+      nk_label (ctx, "time per phase, not profiled (PROFILE_MODE=0)",
+                NK_TEXT_LEFT);
+#endif
+      nk_layout_row_dynamic (ctx, 16, 2);
+      for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
         {
-          fprintf (stderr, "nread = %lu (of %u)\n", nread, num_cols * num_rows);
-          fclose (images_fh);
-          fclose (labels_fh);
-          exit (EXIT_FAILURE);
+          if (snapshot->phase_seconds[p] <= 0.f)
+            continue;
+          snprintf (text, sizeof (text), "%s %.2fs", profile_phase_names[p],
+                    snapshot->phase_seconds[p]);
+          nk_label (ctx, text, NK_TEXT_LEFT);
+          nk_prog (ctx, (nk_size) (1000.f * snapshot->phase_seconds[p]
+                                   / total_seconds), 1000, nk_false);
         }
-      for (u32 k = 0; k < sizeof (buffer) / sizeof (buffer[0]); ++k, ++j)
-        images_buffer[j] = ((float) buffer[k]) / 255.f;
 
-      u8 label = (u8) -1;
-      (void) fread (&label, sizeof (label), 1, labels_fh);
-      if (label >= 10)
+      nk_layout_row_dynamic (ctx, 20, 1);
+      nk_label (ctx, "busy per work queue thread", NK_TEXT_LEFT);
+      nk_layout_row_dynamic (ctx, 16, 2);
+      for (u32 i = 0; i < snapshot->nthreads; ++i)
         {
-          fprintf (stderr, "label = %u\n", label);
-          fclose (images_fh);
-          fclose (labels_fh);
-          exit (EXIT_FAILURE);
+          if (i == 0)
+            snprintf (text, sizeof (text), "trainer %3.0f%%",
+                      100.f * snapshot->utilization[i]);
+          else
+            snprintf (text, sizeof (text), "worker %u %3.0f%%", i,
+                      100.f * snapshot->utilization[i]);
+          nk_label (ctx, text, NK_TEXT_LEFT);
+          nk_prog (ctx, (nk_size) (1000.f * snapshot->utilization[i]), 1000,
+                   nk_false);
         }
 
-      for (u8 k = 0; k < 10; ++k, ++j)
-        images_buffer[j] = (k == label) ? 1.f : 0.f;
+      if (snapshot->npoints > 0)
+        {
+          update_chart (ctx, "cost", snapshot->cost, snapshot->npoints);
+          update_chart (ctx, "accuracy", snapshot->accuracy,
+                        snapshot->npoints);
+        }
     }
-
-  network_sgd (app_network, images_buffer, num_images, 30, 0.025f, 5.f);
-
-  fclose (images_fh);
-  fclose (labels_fh);
+  nk_end (ctx);
 }
 
-void
-app_init ()
+// Weight colours as 0x00RRGGBB, red below zero and green above with blue
+// fading out as either reaches 4
+static inline __m128i
+heatmap_colors_x4 (__m128 values)
 {
-  u32 sizes[] = {784, 30, 10};
-  app_network = create_network (sizes, ARRAY_COUNT (sizes), 10);
-  app_work_queue = create_work_queue (2, 1);
-
-  enqueue_work (app_work_queue, do_training_work, NULL);
+  __m128 zero = _mm_setzero_ps ();
+  __m128 limit = _mm_set1_ps (256.f);
+  __m128 scaled = _mm_mul_ps (values, _mm_set1_ps (64.f));
+  __m128 red = _mm_min_ps (_mm_max_ps (_mm_sub_ps (zero, scaled), zero), limit);
+  __m128 green = _mm_min_ps (_mm_max_ps (scaled, zero), limit);
+  __m128 blue = _mm_sub_ps (limit, _mm_add_ps (red, green));
+  __m128i max = _mm_set1_epi32 (255);
+  __m128i r = _mm_min_epi32 (_mm_cvttps_epi32 (red), max);
+  __m128i g = _mm_min_epi32 (_mm_cvttps_epi32 (green), max);
+  __m128i b = _mm_min_epi32 (_mm_cvttps_epi32 (blue), max);
+  return _mm_or_si128 (_mm_or_si128 (_mm_slli_epi32 (r, 16),
+                                     _mm_slli_epi32 (g, 8)), b);
 }
 
-void
-app_shutdown ()
+// One cell per weight, the bias first and a gap of `background' before
+// the weights of each row. False and no image if it can't be made.
+static bool
+rasterize_heatmap (struct nk_image *image, WeightSnapshotLayer *layer,
+                   u32 cell_width, u32 cell_height, u32 background)
 {
-  destroy_work_queue (app_work_queue);
-  destroy_network (app_network);
+  u32 ncells = layer->width + 2;
+  u64 width = (u64) ncells * cell_width;
+  u64 height = (u64) layer->height * cell_height;
+  if (width > USHRT_MAX || height > USHRT_MAX) // What nk_image holds
+    {
+      nk_xsurf_image_free (image);
+      return false;
+    }
+  if (!image->handle.ptr || image->w != width || image->h != height)
+    {
+      nk_xsurf_image_free (image);
+      *image = nk_xsurf_create_image (width, height);
+    }
+  u32 *pixels = nk_xsurf_image_pixels (*image);
+  if (!pixels)
+    return false;
+
+  alignas (16) u32 colors[WEIGHT_SNAPSHOT_MAX_WIDTH + 2 + 3];
+  for (u32 y = 0; y < layer->height; ++y)
+    {
+      float *weights = layer->weights + ((u64) y * layer->width);
+      u32 x = 0;
+      for (; x + 4 <= layer->width; x += 4)
+        _mm_storeu_si128 ((__m128i *) &colors[x + 2],
+                          heatmap_colors_x4 (_mm_loadu_ps (weights + x)));
+      if (x < layer->width)
+        {
+          float tail[4] = {};
+          memcpy (tail, weights + x, sizeof (float) * (layer->width - x));
+          _mm_storeu_si128 ((__m128i *) &colors[x + 2],
+                            heatmap_colors_x4 (_mm_loadu_ps (tail)));
+        }
+      alignas (16) u32 bias[4];
+      _mm_store_si128 ((__m128i *) bias,
+                       heatmap_colors_x4 (_mm_set1_ps (layer->biases[y])));
+      colors[0] = bias[0];
+      colors[1] = background;
+
+      u32 *row = pixels + ((u64) y * cell_height * width);
+      for (u32 c = 0, offset = 0; c < ncells; ++c)
+        {
+          for (u32 i = 0; i < cell_width; ++i)
+            row[offset++] = colors[c];
+        }
+      for (u32 i = 1; i < cell_height; ++i)
+        memcpy (row + ((u64) i * width), row, sizeof (u32) * width);
+    }
+  return true;
 }
 
 void
@@ -111,59 +238,55 @@ app_update_ui (struct nk_context *ctx, float dt)
 {
   (void) dt;
 
-  if (nk_begin (ctx, "Demo",
-                nk_rect (0, 0, g_platform->window.width, g_platform->window.height),
-                0))
+  float width = g_platform->window.width;
+  float height = g_platform->window.height;
+  float panel_width = MIN ((float) APP_PANEL_WIDTH, width / 2);
+  update_telemetry_panel (ctx, nk_rect (width - panel_width, 0, panel_width,
+                                        height));
+
+  if (nk_begin (ctx, "Demo", nk_rect (0, 0, width - panel_width, height), 0))
     {
       struct nk_command_buffer *canvas = nk_window_get_canvas (ctx);
       struct nk_rect size = nk_layout_space_bounds (ctx);
       float ui_y = size.y + 20;
-      float cell_width  = 2.f;
-      float cell_height = 2.f;
+      u32 canvas_width = (u32) MAX (size.w, 0.f);
+      u32 canvas_height = (u32) MAX (size.h, 0.f);
+      u32 cell_size = 2; // Doubled every layer
 
-      for (u32 i = 0; i < app_network->layers.nmemb; ++i)
+      // Never the live parameters, the trainer is writing those. Only
+      // rasterized again when a new one came in.
+      WeightSnapshot *snapshot = acquire_weight_snapshot (app_network);
+      bool changed = (snapshot != app_heatmap_snapshot
+                      || snapshot->step_count != app_heatmap_step);
+      app_heatmap_snapshot = snapshot;
+      app_heatmap_step = snapshot->step_count;
+
+      struct nk_color bg = ctx->style.window.fixed_background.data.color;
+      u32 background = ((u32) bg.r << 16) | ((u32) bg.g << 8) | bg.b;
+      u32 nlayers = MIN (snapshot->nlayers, (u32) APP_MAX_HEATMAPS);
+      for (u32 i = 0; i < nlayers; ++i)
         {
-          NetworkLayer *layer = &app_network->layers.base[i];
-          u32 width = layer->width;
-          u32 height = layer->height;
-          for (u32 y = 0; y < height; ++y)
+          WeightSnapshotLayer *layer = &snapshot->layers[i];
+          struct nk_image *image = &app_heatmaps[i];
+          // Never larger than the window shows, at least a pixel a cell
+          u32 ncells = layer->width + 2;
+          u32 fit = MIN (canvas_width / ncells,
+                         canvas_height / MAX (layer->height, 1u));
+          u32 cell = MAX (MIN (cell_size, fit), 1u);
+          cell_size = MIN (cell_size * 2, (u32) USHRT_MAX);
+
+          // Again when the window resized the cells
+          bool resized = (image->w != ncells * cell
+                          || image->h != layer->height * cell);
+          if (changed || resized || !image->handle.ptr)
             {
-              {
-                float value  = layer->biases[y];
-                float red    = (value < 0) ? MIN (-value, 4.f) : 0;
-                float green  = (value > 0) ? MIN ( value, 4.f) : 0;
-                float blue   = 4.f - (red + green);
-                nk_fill_rect (canvas,
-                              nk_rect (size.x,
-                                       ui_y + (y * cell_height),
-                                       cell_width,
-                                       cell_height),
-                              0.f,
-                              nk_rgb ((int) (red   * 64),
-                                      (int) (green * 64),
-                                      (int) (blue  * 64)));
-              }
-              for (u32 x = 0, offset = y * width; x < width; ++x)
-                {
-                  float value  = layer->weights[offset + x];
-                  float red    = (value < 0) ? MIN (-value, 4.f) : 0;
-                  float green  = (value > 0) ? MIN ( value, 4.f) : 0;
-                  float blue   = 4.f - (red + green);
-                  nk_fill_rect (canvas,
-                                nk_rect (size.x + ((x + 2) * cell_width),
-                                         ui_y + (y * cell_height),
-                                         cell_width,
-                                         cell_height),
-                                0.f,
-                                nk_rgb ((int) (red   * 64),
-                                        (int) (green * 64),
-                                        (int) (blue  * 64)));
-                }
+              if (!rasterize_heatmap (image, layer, cell, cell, background))
+                continue;
             }
-          ui_y += (height * cell_height) + 20;
-
-          cell_width  *= 2;
-          cell_height *= 2;
+          nk_draw_image (canvas,
+                         nk_rect (size.x, ui_y, image->w, image->h),
+                         image, nk_rgb (255, 255, 255));
+          ui_y += image->h + 20;
         }
     }
   nk_end (ctx);
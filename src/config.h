@@ -0,0 +1,459 @@
+#ifndef CONFIG_H
+#define CONFIG_H 1
+
+#include "network.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_MAX_LAYERS 16
+#define CONFIG_MAX_PATH 256
+#define CONFIG_MAX_LINE 512
+
+typedef struct
+{
+  u32               sizes[CONFIG_MAX_LAYERS];
+  u32               nsizes;
+  u32               mini_batch_size;
+  u32               epochs;
+  float             eta;
+  float             lmbda;
+  u32               thread_count; // Including the calling thread
+  u32               trainer_count; // Processes
+  u32               sync_interval;
+  bool              async_sgd;
+  u32               pipeline_micro_batch_size;
+  bool              split_layers;
+  TrainingSchedule  schedule;
+  u64               seed; // 0 skips the deterministic mode
+  float             dropout_rate;
+  Augmentation      augmentation;
+  char              images_path[CONFIG_MAX_PATH];
+  char              labels_path[CONFIG_MAX_PATH];
+  bool              profile; // Print the phase timings when done
+  bool              counters; // Hardware counters in the profile
+  char              trace_path[CONFIG_MAX_PATH]; // Empty for no trace
+} AppConfig;
+
+typedef enum
+{
+  CONFIG_TYPE_U32,
+  CONFIG_TYPE_U64,
+  CONFIG_TYPE_FLOAT,
+  CONFIG_TYPE_BOOL,
+  CONFIG_TYPE_PATH,
+  CONFIG_TYPE_SIZES,
+  CONFIG_TYPE_SCHEDULE,
+  CONFIG_TYPE_BATCH_STEPS,
+  CONFIG_TYPE_OPTIMIZER
+} ConfigType;
+
+typedef struct
+{
+  const char   *name;
+  ConfigType    type;
+  size_t        offset;
+} ConfigOption;
+
+static const ConfigOption config_options[] = {
+  {"sizes",             CONFIG_TYPE_SIZES,      offsetof (AppConfig, sizes)},
+  {"mini_batch_size",   CONFIG_TYPE_U32,
+   offsetof (AppConfig, mini_batch_size)},
+  {"epochs",            CONFIG_TYPE_U32,        offsetof (AppConfig, epochs)},
+  {"eta",               CONFIG_TYPE_FLOAT,      offsetof (AppConfig, eta)},
+  {"lambda",            CONFIG_TYPE_FLOAT,      offsetof (AppConfig, lmbda)},
+  {"threads",           CONFIG_TYPE_U32,
+   offsetof (AppConfig, thread_count)},
+  {"trainers",          CONFIG_TYPE_U32,
+   offsetof (AppConfig, trainer_count)},
+  {"sync_interval",     CONFIG_TYPE_U32,
+   offsetof (AppConfig, sync_interval)},
+  {"optimizer",         CONFIG_TYPE_OPTIMIZER,  offsetof (AppConfig, async_sgd)},
+  {"pipeline",          CONFIG_TYPE_U32,
+   offsetof (AppConfig, pipeline_micro_batch_size)},
+  {"split_layers",      CONFIG_TYPE_BOOL,
+   offsetof (AppConfig, split_layers)},
+  {"schedule",          CONFIG_TYPE_SCHEDULE,
+   offsetof (AppConfig, schedule.kind)},
+  {"step_epochs",       CONFIG_TYPE_U32,
+   offsetof (AppConfig, schedule.step_epochs)},
+  {"decay",             CONFIG_TYPE_FLOAT,
+   offsetof (AppConfig, schedule.decay)},
+  {"min_eta",           CONFIG_TYPE_FLOAT,
+   offsetof (AppConfig, schedule.min_eta)},
+  {"plateau_patience",  CONFIG_TYPE_U32,
+   offsetof (AppConfig, schedule.plateau_patience)},
+  {"patience",          CONFIG_TYPE_U32,
+   offsetof (AppConfig, schedule.patience)},
+  {"batch_steps",       CONFIG_TYPE_BATCH_STEPS,
+   offsetof (AppConfig, schedule)},
+  {"seed",              CONFIG_TYPE_U64,        offsetof (AppConfig, seed)},
+  {"dropout",           CONFIG_TYPE_FLOAT,
+   offsetof (AppConfig, dropout_rate)},
+  {"image_width",       CONFIG_TYPE_U32,
+   offsetof (AppConfig, augmentation.image_width)},
+  {"image_height",      CONFIG_TYPE_U32,
+   offsetof (AppConfig, augmentation.image_height)},
+  {"max_shift",         CONFIG_TYPE_U32,
+   offsetof (AppConfig, augmentation.max_shift)},
+  {"max_rotation",      CONFIG_TYPE_FLOAT,
+   offsetof (AppConfig, augmentation.max_rotation)},
+  {"noise",             CONFIG_TYPE_FLOAT,
+   offsetof (AppConfig, augmentation.noise)},
+  {"images",            CONFIG_TYPE_PATH,
+   offsetof (AppConfig, images_path)},
+  {"labels",            CONFIG_TYPE_PATH,
+   offsetof (AppConfig, labels_path)},
+  {"profile",           CONFIG_TYPE_BOOL,       offsetof (AppConfig, profile)},
+  {"counters",          CONFIG_TYPE_BOOL,
+   offsetof (AppConfig, counters)},
+  {"trace",             CONFIG_TYPE_PATH,
+   offsetof (AppConfig, trace_path)},
+};
+
+static const char *schedule_names[] = {
+  [LEARNING_RATE_CONSTANT]  = "constant",
+  [LEARNING_RATE_STEP]      = "step",
+  [LEARNING_RATE_COSINE]    = "cosine",
+  [LEARNING_RATE_PLATEAU]   = "plateau"
+};
+
+AppConfig
+default_app_config ()
+{
+  AppConfig config = {
+    .sizes                      = {784, 30, 10},
+    .nsizes                     = 3,
+    .mini_batch_size            = 10,
+    .epochs                     = 30,
+    .eta                        = 0.025f,
+    .lmbda                      = 5.f,
+    .thread_count               = NETWORK_DEFAULT_THREAD_COUNT + 1,
+    .trainer_count              = 1,
+    .sync_interval              = 1,
+    .async_sgd                  = false,
+    .pipeline_micro_batch_size  = 0,
+    .split_layers               = false,
+    .schedule = {
+      .kind     = LEARNING_RATE_CONSTANT,
+      .min_eta  = 0.001f
+    },
+    .seed                       = 0,
+    .dropout_rate               = 0.f,
+    .augmentation = {
+      .image_width  = 28,
+      .image_height = 28
+    },
+    .images_path                = "data/train-images-idx3-ubyte",
+    .labels_path                = "data/train-labels-idx1-ubyte",
+    .profile                    = false,
+    .counters                   = false,
+    .trace_path                 = ""
+  };
+  return config;
+}
+
+static bool
+parse_config_u64 (const char *value, u64 *out)
+{
+  char *end;
+  if (*value == '\0' || *value == '-')
+    return false;
+  *out = strtoull (value, &end, 0);
+  return (*end == '\0');
+}
+
+static bool
+parse_config_u32 (const char *value, u32 *out)
+{
+  u64 wide;
+  if (!parse_config_u64 (value, &wide) || wide > (u32) -1)
+    return false;
+  *out = (u32) wide;
+  return true;
+}
+
+static bool
+parse_config_sizes (const char *value, AppConfig *config)
+{
+  char buffer[CONFIG_MAX_LINE];
+  if (strlen (value) >= sizeof (buffer))
+    return false;
+  strcpy (buffer, value);
+
+  u32 nsizes = 0;
+  u32 sizes[CONFIG_MAX_LAYERS];
+  for (char *save, *token = strtok_r (buffer, ",", &save);
+       token;
+       token = strtok_r (NULL, ",", &save))
+    {
+      if (nsizes == CONFIG_MAX_LAYERS
+          || !parse_config_u32 (token, &sizes[nsizes])
+          || sizes[nsizes] == 0)
+        return false;
+      ++nsizes;
+    }
+  if (nsizes < 2)
+    return false;
+
+  memcpy (config->sizes, sizes, sizeof (sizes[0]) * nsizes);
+  config->nsizes = nsizes;
+  return true;
+}
+
+// `EPOCH:SIZE,...' with ascending epochs, empty for none
+static bool
+parse_config_batch_steps (const char *value, TrainingSchedule *schedule)
+{
+  char buffer[CONFIG_MAX_LINE];
+  if (strlen (value) >= sizeof (buffer))
+    return false;
+  strcpy (buffer, value);
+
+  u32 nsteps = 0;
+  BatchStep steps[SCHEDULE_MAX_BATCH_STEPS];
+  for (char *save, *token = strtok_r (buffer, ",", &save);
+       token;
+       token = strtok_r (NULL, ",", &save))
+    {
+      char *colon = strchr (token, ':');
+      if (nsteps == SCHEDULE_MAX_BATCH_STEPS || !colon)
+        return false;
+      *colon = '\0';
+      BatchStep *step = &steps[nsteps];
+      if (!parse_config_u32 (token, &step->epoch)
+          || !parse_config_u32 (colon + 1, &step->mini_batch_size)
+          || step->mini_batch_size == 0
+          || (nsteps > 0 && step->epoch <= steps[nsteps - 1].epoch))
+        return false;
+      ++nsteps;
+    }
+
+  memcpy (schedule->batch_steps, steps, sizeof (steps[0]) * nsteps);
+  schedule->nbatch_steps = nsteps;
+  return true;
+}
+
+// Set the option `name' from its textual `value'
+bool
+set_config_value (AppConfig *config, const char *name, const char *value)
+{
+  const ConfigOption *option = NULL;
+  for (u32 i = 0; i < ARRAY_COUNT (config_options); ++i)
+    {
+      if (strcmp (config_options[i].name, name) == 0)
+        {
+          option = &config_options[i];
+          break;
+        }
+    }
+  if (!option)
+    return false;
+
+  void *field = (u8 *) config + option->offset;
+  switch (option->type)
+    {
+    case CONFIG_TYPE_U32:
+      return parse_config_u32 (value, (u32 *) field);
+    case CONFIG_TYPE_U64:
+      return parse_config_u64 (value, (u64 *) field);
+    case CONFIG_TYPE_FLOAT:
+      {
+        char *end;
+        float number = strtof (value, &end);
+        if (*value == '\0' || *end != '\0')
+          return false;
+        *(float *) field = number;
+        return true;
+      }
+    case CONFIG_TYPE_BOOL:
+      if (strcmp (value, "true") == 0 || strcmp (value, "1") == 0)
+        *(bool *) field = true;
+      else if (strcmp (value, "false") == 0 || strcmp (value, "0") == 0)
+        *(bool *) field = false;
+      else
+        return false;
+      return true;
+    case CONFIG_TYPE_PATH:
+      if (strlen (value) >= CONFIG_MAX_PATH)
+        return false;
+      strcpy ((char *) field, value);
+      return true;
+    case CONFIG_TYPE_SIZES:
+      return parse_config_sizes (value, config);
+    case CONFIG_TYPE_SCHEDULE:
+      for (u32 i = 0; i < ARRAY_COUNT (schedule_names); ++i)
+        {
+          if (strcmp (schedule_names[i], value) == 0)
+            {
+              *(LearningRateSchedule *) field = (LearningRateSchedule) i;
+              return true;
+            }
+        }
+      return false;
+    case CONFIG_TYPE_BATCH_STEPS:
+      return parse_config_batch_steps (value, (TrainingSchedule *) field);
+    case CONFIG_TYPE_OPTIMIZER:
+      // Plain SGD with L2 decay, synchronous or Hogwild
+      if (strcmp (value, "sgd") == 0)
+        *(bool *) field = false;
+      else if (strcmp (value, "hogwild") == 0)
+        *(bool *) field = true;
+      else
+        return false;
+      return true;
+    }
+  return false;
+}
+
+static char *
+trim_config_text (char *text)
+{
+  while (*text == ' ' || *text == '\t')
+    ++text;
+  char *end = text + strlen (text);
+  while (end > text && (end[-1] == ' ' || end[-1] == '\t'
+                        || end[-1] == '\n' || end[-1] == '\r'))
+    *--end = '\0';
+  return text;
+}
+
+// `name = value' lines, `#' starts a comment
+bool
+load_config_file (AppConfig *config, const char *path)
+{
+  FILE *fh = fopen (path, "r");
+  if (!fh)
+    {
+      fprintf (stderr, "%s: cannot open config file\n", path);
+      return false;
+    }
+
+  bool success = true;
+  char line[CONFIG_MAX_LINE];
+  for (u32 line_number = 1; fgets (line, sizeof (line), fh); ++line_number)
+    {
+      char *comment = strchr (line, '#');
+      if (comment)
+        *comment = '\0';
+      char *text = trim_config_text (line);
+      if (*text == '\0')
+        continue;
+
+      char *equals = strchr (text, '=');
+      if (equals)
+        *equals = '\0';
+      char *name = trim_config_text (text);
+      char *value = equals ? trim_config_text (equals + 1) : "";
+      if (!equals || !set_config_value (config, name, value))
+        {
+          fprintf (stderr, "%s:%u: bad option `%s'\n", path, line_number, name);
+          success = false;
+        }
+    }
+
+  fclose (fh);
+  return success;
+}
+
+static bool
+augmentation_enabled (Augmentation *augmentation)
+{
+  return (augmentation->max_shift > 0 || augmentation->max_rotation > 0.f
+          || augmentation->noise > 0.f);
+}
+
+// Reject combinations the network would assert on
+bool
+validate_app_config (AppConfig *config)
+{
+  const char *error = NULL;
+  if (config->mini_batch_size == 0)
+    error = "mini_batch_size must be positive";
+  else if (config->epochs == 0)
+    error = "epochs must be positive";
+  else if (config->thread_count == 0)
+    error = "threads must be positive";
+  else if (config->trainer_count == 0 || config->sync_interval == 0)
+    error = "trainers and sync_interval must be positive";
+  else if (config->async_sgd && config->trainer_count > 1)
+    error = "the hogwild optimizer runs in a single process";
+  else if (config->async_sgd && config->seed != 0)
+    error = "the hogwild optimizer can not be seeded";
+  else if (config->async_sgd
+           && (config->pipeline_micro_batch_size > 0 || config->split_layers))
+    error = "the hogwild optimizer has no pipeline or split layers";
+  else if (config->dropout_rate < 0.f || config->dropout_rate >= 1.f)
+    error = "dropout must be in [0, 1)";
+  else if (config->schedule.kind == LEARNING_RATE_STEP
+           && config->schedule.step_epochs == 0)
+    error = "the step schedule needs step_epochs";
+  else if ((config->schedule.kind == LEARNING_RATE_STEP
+            || config->schedule.kind == LEARNING_RATE_PLATEAU)
+           && (config->schedule.decay <= 0.f
+               || config->schedule.decay >= 1.f))
+    error = "the step and plateau schedules need a decay in (0, 1)";
+  else if (augmentation_enabled (&config->augmentation)
+           && (config->augmentation.image_width
+               * config->augmentation.image_height) != config->sizes[0])
+    error = "image_width * image_height must match the input size";
+
+  if (error)
+    fprintf (stderr, "config: %s\n", error);
+  return (error == NULL);
+}
+
+void
+print_config_usage (FILE *out, const char *program)
+{
+  fprintf (out, "usage: %s [--config=FILE] [--NAME=VALUE]...\n", program);
+  fprintf (out, "options:");
+  for (u32 i = 0; i < ARRAY_COUNT (config_options); ++i)
+    fprintf (out, "%s%s", (i % 6) ? " " : "\n  ", config_options[i].name);
+  fprintf (out, "\n");
+}
+
+// Options as `--name=value' or `--name value', a `--config' file is
+// applied where it appears so later options override it
+bool
+parse_config_args (AppConfig *config, int argc, char **argv)
+{
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strncmp (argv[i], "--", 2) != 0)
+        {
+          fprintf (stderr, "unexpected argument `%s'\n", argv[i]);
+          return false;
+        }
+
+      char name[CONFIG_MAX_LINE];
+      const char *arg = argv[i] + 2;
+      const char *value = strchr (arg, '=');
+      size_t name_length = value ? (size_t) (value - arg) : strlen (arg);
+      if (name_length >= sizeof (name))
+        return false;
+      memcpy (name, arg, name_length);
+      name[name_length] = '\0';
+      if (value)
+        ++value;
+      else if (i + 1 < argc)
+        value = argv[++i];
+      else
+        value = "";
+
+      bool success;
+      if (strcmp (name, "config") == 0)
+        success = load_config_file (config, value);
+      else
+        success = set_config_value (config, name, value);
+      if (!success)
+        {
+          fprintf (stderr, "bad option `--%s=%s'\n", name, value);
+          return false;
+        }
+    }
+  return validate_app_config (config);
+}
+
+#endif /* ! CONFIG_H */
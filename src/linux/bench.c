@@ -0,0 +1,623 @@
+#define _GNU_SOURCE // For sched_setaffinity
+
+// Microbenchmarks for the network kernels. Writes one JSON object with a
+// result per line, so two runs diff cleanly, and can compare against an
+// earlier run to flag regressions. Bandwidth is relative to streaming
+// reads from a buffer as large as the traffic of a call per thread, so
+// cache resident kernels compare against the cache they run from. With
+// --counters every result also gets the hardware counters of the calling
+// thread per call, from one extra pass after the timed ones.
+//
+// usage: bench [--out=FILE] [--baseline=FILE] [--threshold=0.1]
+//              [--min-time=0.2] [--counters]
+
+#include "../types.h"
+#include "../platform.h"
+#include "../memory.h"
+#include "../maths.h"
+#include "../network.h"
+
+#include "linux_platform.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+#define BENCH_MAX_RESULTS 256
+#define BENCH_KEY_SIZE 64
+#define BENCH_TRIALS 3
+#define BENCH_PEAK_BUFFER_SIZE (256 * 1024 * 1024) // Bytes, well past LLC
+#define BENCH_PEAK_MIN_SIZE (16 * 1024) // Bytes, fits any L1
+#define BENCH_PEAK_SIZES 15 // Doubling up to the buffer size
+
+typedef struct
+{
+  char      key[BENCH_KEY_SIZE];
+  double    ns; // Per call, best of BENCH_TRIALS
+  double    flops; // Per call, 0 when not meaningful
+  double    bytes; // Per call, compulsory traffic
+  u32       threads; // Working on one call
+  bool      counted;
+  double    counters[COUNTER_COUNT]; // Per call, of the calling thread
+} BenchResult;
+
+typedef void (*BenchCallback) (void *);
+
+static struct
+{
+  MemoryPool    mpool;
+  BenchResult   results[BENCH_MAX_RESULTS];
+  u32           nresults;
+  double        min_seconds;
+  double        peak_gflops; // Per thread
+  double        peak_gbs[BENCH_PEAK_SIZES]; // Per thread, by buffer size
+  bool          use_counters;
+  bool          counted; // Of the last `time_callback'
+  double        counters[COUNTER_COUNT];
+  volatile float sink; // Keeps results alive
+} g_bench = {
+  .min_seconds = 0.2
+};
+
+// Calls per trial grow until a trial takes `min_seconds'
+static double
+time_callback (BenchCallback callback, void *data)
+{
+  u64 min_ticks = (u64) (g_bench.min_seconds * TICKS_PER_SECOND);
+  u64 ncalls = 1;
+  u64 ticks;
+  for (;;)
+    {
+      u64 start = get_ticks ();
+      for (u64 i = 0; i < ncalls; ++i)
+        callback (data);
+      ticks = get_ticks () - start;
+      if (ticks >= min_ticks / BENCH_TRIALS)
+        break;
+      ncalls *= 2;
+    }
+
+  double best = (double) ticks / ncalls;
+  for (u32 trial = 1; trial < BENCH_TRIALS; ++trial)
+    {
+      u64 start = get_ticks ();
+      for (u64 i = 0; i < ncalls; ++i)
+        callback (data);
+      double ns = (double) (get_ticks () - start) / ncalls;
+      best = MIN (best, ns);
+    }
+
+  u64 before[COUNTER_COUNT];
+  u64 after[COUNTER_COUNT];
+  g_bench.counted = (g_bench.use_counters && read_counters (before));
+  if (g_bench.counted)
+    {
+      for (u64 i = 0; i < ncalls; ++i)
+        callback (data);
+      g_bench.counted = read_counters (after);
+      for (u32 i = 0; i < COUNTER_COUNT; ++i)
+        g_bench.counters[i] = (double) (after[i] - before[i]) / ncalls;
+    }
+
+  return best * (1e9 / TICKS_PER_SECOND);
+}
+
+static bool
+has_result (const char *key)
+{
+  for (u32 i = 0; i < g_bench.nresults; ++i)
+    {
+      if (strcmp (g_bench.results[i].key, key) == 0)
+        return true;
+    }
+  return false;
+}
+
+static void
+add_result (const char *key, double ns, double flops, double bytes,
+            u32 threads)
+{
+  assert (g_bench.nresults < BENCH_MAX_RESULTS);
+  // Keys name the JSON results, a repeat would hide one of them
+  if (has_result (key))
+    {
+      fprintf (stderr, "duplicate result `%s'\n", key);
+      abort ();
+    }
+  BenchResult *result = &g_bench.results[g_bench.nresults++];
+  snprintf (result->key, sizeof (result->key), "%s", key);
+  result->ns = ns;
+  result->flops = flops;
+  result->bytes = bytes;
+  result->threads = threads;
+  // Always right after the `time_callback' of this result
+  result->counted = g_bench.counted;
+  memcpy (result->counters, g_bench.counters, sizeof (result->counters));
+  fprintf (stderr, "%-48s %12.1f ns\n", key, ns);
+}
+
+static float *
+random_floats (u32 nmemb, float scale)
+{
+  static Random random;
+  static bool seeded;
+  if (!seeded)
+    {
+      seed_random (&random, 1);
+      seeded = true;
+    }
+  float *result = push_array_aligned (&g_bench.mpool, float,
+                                      SIMD_PADDED (nmemb),
+                                      PARAMETER_ALIGNMENT, MEMORY_FLAG_ZERO);
+  fill_gaussian_noise (&random, result, nmemb, 0, scale);
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  __m128   *data;
+  u32       nmemb; // Vectors
+  u32       iterations;
+} PeakData;
+
+static void
+do_peak_flops (void *user_data)
+{
+  PeakData *peak = (PeakData *) user_data;
+  // Eight independent chains hide the add and mul latencies
+  __m128 x = _mm_set1_ps (0.999f);
+  __m128 y = _mm_set1_ps (0.001f);
+  __m128 acc[8];
+  for (u32 i = 0; i < 8; ++i)
+    acc[i] = _mm_set1_ps ((float) i);
+  for (u32 k = 0; k < peak->iterations; ++k)
+    {
+      for (u32 i = 0; i < 8; ++i)
+        acc[i] = _mm_add_ps (_mm_mul_ps (acc[i], x), y);
+    }
+  __m128 sum = _mm_setzero_ps ();
+  for (u32 i = 0; i < 8; ++i)
+    sum = _mm_add_ps (sum, acc[i]);
+  g_bench.sink += horizontal_sum (sum);
+}
+
+static void
+do_peak_bandwidth (void *user_data)
+{
+  PeakData *peak = (PeakData *) user_data;
+  __m128 sum0 = _mm_setzero_ps ();
+  __m128 sum1 = _mm_setzero_ps ();
+  __m128 sum2 = _mm_setzero_ps ();
+  __m128 sum3 = _mm_setzero_ps ();
+  __m128 sum4 = _mm_setzero_ps ();
+  __m128 sum5 = _mm_setzero_ps ();
+  __m128 sum6 = _mm_setzero_ps ();
+  __m128 sum7 = _mm_setzero_ps ();
+  // Enough chains to keep both load ports busy on cache resident data
+  for (u32 i = 0; i < peak->nmemb; i += 8)
+    {
+      sum0 = _mm_add_ps (sum0, peak->data[i]);
+      sum1 = _mm_add_ps (sum1, peak->data[i + 1]);
+      sum2 = _mm_add_ps (sum2, peak->data[i + 2]);
+      sum3 = _mm_add_ps (sum3, peak->data[i + 3]);
+      sum4 = _mm_add_ps (sum4, peak->data[i + 4]);
+      sum5 = _mm_add_ps (sum5, peak->data[i + 5]);
+      sum6 = _mm_add_ps (sum6, peak->data[i + 6]);
+      sum7 = _mm_add_ps (sum7, peak->data[i + 7]);
+    }
+  sum0 = _mm_add_ps (_mm_add_ps (sum0, sum1), _mm_add_ps (sum2, sum3));
+  sum4 = _mm_add_ps (_mm_add_ps (sum4, sum5), _mm_add_ps (sum6, sum7));
+  sum0 = _mm_add_ps (sum0, sum4);
+  g_bench.sink += horizontal_sum (sum0);
+}
+
+static u64
+peak_size (u32 index)
+{
+  return (u64) BENCH_PEAK_MIN_SIZE << index;
+}
+
+// Single thread peaks measured on this machine, SSE mul + add and
+// streaming reads from buffers that fit each cache level up to memory
+static void
+measure_peaks ()
+{
+  _Static_assert ((u64) BENCH_PEAK_MIN_SIZE << (BENCH_PEAK_SIZES - 1)
+                  == BENCH_PEAK_BUFFER_SIZE, "peak sizes end at the buffer");
+
+  PeakData peak = {.iterations = 1024 * 1024};
+  double ns = time_callback (do_peak_flops, &peak);
+  g_bench.peak_gflops = (8. * 4. * 2. * peak.iterations) / ns;
+
+  peak.data = push_array_aligned (&g_bench.mpool, __m128,
+                                  BENCH_PEAK_BUFFER_SIZE / sizeof (__m128),
+                                  PARAMETER_ALIGNMENT, MEMORY_FLAG_ZERO);
+  for (u32 i = 0; i < BENCH_PEAK_SIZES; ++i)
+    {
+      peak.nmemb = (u32) (peak_size (i) / sizeof (__m128));
+      ns = time_callback (do_peak_bandwidth, &peak);
+      g_bench.peak_gbs[i] = (double) peak_size (i) / ns;
+    }
+}
+
+// The smallest peak buffer holding `bytes'
+static u32
+peak_index (double bytes)
+{
+  for (u32 i = 0; i < BENCH_PEAK_SIZES - 1; ++i)
+    {
+      if (bytes <= (double) peak_size (i))
+        return i;
+    }
+  return BENCH_PEAK_SIZES - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  float    *a;
+  float    *b;
+  float    *out;
+  u32       n;
+  u32       m;
+} KernelData;
+
+static void
+do_mat_nm_vec_m_product (void *user_data)
+{
+  KernelData *k = (KernelData *) user_data;
+  mat_nm_vec_m_product (k->a, k->b, k->n, k->m, k->out);
+  g_bench.sink += k->out[0];
+}
+
+static void
+do_mat_nm_vec_m_transpose_product (void *user_data)
+{
+  KernelData *k = (KernelData *) user_data;
+  mat_nm_vec_m_transpose_product (k->a, k->b, k->n, k->m, k->out);
+  g_bench.sink += k->out[0];
+}
+
+static void
+do_mat_1n_mat_m1_product (void *user_data)
+{
+  KernelData *k = (KernelData *) user_data;
+  mat_1n_mat_m1_product (k->a, k->b, k->n, k->m, k->out);
+  g_bench.sink += k->out[0];
+}
+
+static void
+do_sigmoid (void *user_data)
+{
+  KernelData *k = (KernelData *) user_data;
+  sigmoid (k->a, k->out, k->n);
+  g_bench.sink += k->out[0];
+}
+
+static void
+bench_kernels (u32 width, u32 height)
+{
+  u32 stride = SIMD_PADDED (width);
+  u32 pheight = SIMD_PADDED (height);
+  char key[BENCH_KEY_SIZE];
+  double matrix_bytes = 4. * stride * height;
+
+  KernelData k = {
+    .a   = random_floats (stride * height, 1.f),
+    .b   = random_floats (MAX (stride, pheight), 1.f),
+    .out = random_floats (MAX (stride * height, MAX (stride, pheight)), 1.f),
+    .n   = stride,
+    .m   = height
+  };
+
+  snprintf (key, sizeof (key), "mat_nm_vec_m_product/%ux%u", width, height);
+  add_result (key, time_callback (do_mat_nm_vec_m_product, &k),
+              2. * width * height, matrix_bytes + 4. * (stride + height), 1);
+
+  snprintf (key, sizeof (key), "mat_nm_vec_m_transpose_product/%ux%u",
+            width, height);
+  add_result (key, time_callback (do_mat_nm_vec_m_transpose_product, &k),
+              2. * width * height, matrix_bytes + 4. * (stride + height), 1);
+
+  // Outer product of a height vector and a width vector
+  k.n = height;
+  k.m = stride;
+  snprintf (key, sizeof (key), "mat_1n_mat_m1_product/%ux%u", width, height);
+  add_result (key, time_callback (do_mat_1n_mat_m1_product, &k),
+              1. * width * height, matrix_bytes + 4. * (stride + height), 1);
+
+  // Counted in elements only, the exponential has no fixed flop cost.
+  // It only depends on the width, shapes that share one time it once.
+  k.n = width;
+  snprintf (key, sizeof (key), "sigmoid/%u", width);
+  if (!has_result (key))
+    add_result (key, time_callback (do_sigmoid, &k), 0., 8. * width, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  Network  *network;
+  float    *samples;
+  u32       sample_size;
+  u32       batch;
+} NetworkData;
+
+static void
+do_feedforward (void *user_data)
+{
+  NetworkData *d = (NetworkData *) user_data;
+  ForwardResult *fr = d->network->validation_forward_result;
+  feedforward (d->network, d->samples, fr);
+  g_bench.sink += fr->layers.base[0].activation[0];
+}
+
+static void
+do_backprop (void *user_data)
+{
+  NetworkData *d = (NetworkData *) user_data;
+  MiniBatchResult *result = &d->network->mini_batch_results.base[0];
+  u32 input_size = d->network->layers.base[0].width;
+  backprop (d->network, d->samples, d->samples + input_size,
+            result->forward, result->backward);
+  g_bench.sink += result->backward->layers.base[0].delta_b[0];
+}
+
+static void
+do_update_mini_batch (void *user_data)
+{
+  NetworkData *d = (NetworkData *) user_data;
+  // A tiny rate keeps the weights from drifting over many calls
+  update_mini_batch (d->network, d->samples, d->batch, 1e-6f, 0.f, 1);
+  g_bench.sink += d->network->parameters.base[0];
+}
+
+static void
+bench_network (u32 *sizes, u32 nsizes, u32 *batches, u32 nbatches)
+{
+  u32 max_batch = 1;
+  for (u32 i = 0; i < nbatches; ++i)
+    max_batch = MAX (max_batch, batches[i]);
+
+  Network *network = create_network (sizes, nsizes, max_batch);
+  u32 input_size = sizes[0];
+  u32 output_size = sizes[nsizes - 1];
+  u32 sample_size = input_size + output_size;
+  NetworkData d = {
+    .network     = network,
+    .samples     = random_floats (sample_size * max_batch, 1.f),
+    .sample_size = sample_size
+  };
+  for (u32 i = 0; i < max_batch; ++i)
+    {
+      float *y = d.samples + (i * sample_size) + input_size;
+      for (u32 j = 0; j < output_size; ++j)
+        y[j] = (j == i % output_size) ? 1.f : 0.f;
+    }
+
+  char topology[BENCH_KEY_SIZE / 2] = "";
+  for (u32 i = 0, length = 0; i < nsizes; ++i)
+    length += snprintf (topology + length, sizeof (topology) - length,
+                        "%s%u", (i > 0) ? "-" : "", sizes[i]);
+
+  double forward_flops = 0.;
+  double backward_flops = 0.;
+  double weight_bytes = 0.;
+  double accumulate_flops = 0.;
+  for (u32 i = 0; i < network->layers.nmemb; ++i)
+    {
+      NetworkLayer *layer = &network->layers.base[i];
+      double nweights = (double) layer->width * layer->height;
+      forward_flops += 2. * nweights + layer->height;
+      if (i > 0)
+        backward_flops += 2. * nweights;
+      accumulate_flops += 2. * nweights;
+      weight_bytes += 4. * layer->stride * layer->height;
+    }
+  double nparameters = network->parameters.nmemb;
+
+  char key[BENCH_KEY_SIZE];
+  snprintf (key, sizeof (key), "feedforward/%s", topology);
+  add_result (key, time_callback (do_feedforward, &d), forward_flops,
+              weight_bytes, 1);
+
+  snprintf (key, sizeof (key), "backprop/%s", topology);
+  add_result (key, time_callback (do_backprop, &d),
+              forward_flops + backward_flops, 2. * weight_bytes, 1);
+
+  for (u32 i = 0; i < nbatches; ++i)
+    {
+      d.batch = batches[i];
+      snprintf (key, sizeof (key), "update_mini_batch/%s/%u", topology,
+                d.batch);
+      // Weights and gradient once more for the update
+      add_result (key, time_callback (do_update_mini_batch, &d),
+                  (d.batch * (forward_flops + backward_flops
+                              + accumulate_flops)) + 3. * nparameters,
+                  (2. * weight_bytes) + (12. * nparameters),
+                  network->thread_count + 1);
+    }
+
+  destroy_network (network);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+write_results (FILE *out)
+{
+  fprintf (out, "{\"machine\": {\"peak_gflops_per_thread\": %.3f, "
+           "\"peak_read_gbs\": {", g_bench.peak_gflops);
+  for (u32 i = 0; i < BENCH_PEAK_SIZES; ++i)
+    fprintf (out, "%s\"%" PRIu64 "\": %.3f", (i > 0) ? ", " : "",
+             peak_size (i), g_bench.peak_gbs[i]);
+  fprintf (out, "}},\n \"results\": [\n");
+  for (u32 i = 0; i < g_bench.nresults; ++i)
+    {
+      BenchResult *r = &g_bench.results[i];
+      double gflops = r->flops / r->ns;
+      double gbs = r->bytes / r->ns;
+      fprintf (out, "  {\"key\": \"%s\", \"ns\": %.1f, \"threads\": %u, ",
+               r->key, r->ns, r->threads);
+      if (r->flops > 0.)
+        fprintf (out, "\"gflops\": %.3f, \"peak_flops_fraction\": %.3f, ",
+                 gflops, gflops / (g_bench.peak_gflops * r->threads));
+      else
+        fprintf (out, "\"gflops\": null, \"peak_flops_fraction\": null, ");
+      // Every thread streams its share from where that share fits
+      u32 peak = peak_index (r->bytes / r->threads);
+      fprintf (out, "\"gbs\": %.3f, \"peak_read_bytes\": %" PRIu64 ", "
+               "\"peak_bandwidth_fraction\": %.3f", gbs, peak_size (peak),
+               gbs / (g_bench.peak_gbs[peak] * r->threads));
+      if (r->counted)
+        fprintf (out, ", \"cycles\": %.0f, \"instructions\": %.0f, "
+                 "\"ipc\": %.3f, \"llc_misses\": %.1f, "
+                 "\"dtlb_misses\": %.1f",
+                 r->counters[COUNTER_CYCLES],
+                 r->counters[COUNTER_INSTRUCTIONS],
+                 (r->counters[COUNTER_INSTRUCTIONS]
+                  / MAX (r->counters[COUNTER_CYCLES], 1.)),
+                 r->counters[COUNTER_LLC_MISSES],
+                 r->counters[COUNTER_DTLB_MISSES]);
+      fprintf (out, "}%s\n", (i + 1 < g_bench.nresults) ? "," : "");
+    }
+  fprintf (out, "]}\n");
+}
+
+// Reads back the per-line results of `write_results' and reports every
+// key that got slower by more than `threshold'
+static bool
+compare_with_baseline (const char *path, double threshold)
+{
+  FILE *fh = fopen (path, "r");
+  if (!fh)
+    {
+      fprintf (stderr, "%s: cannot open baseline\n", path);
+      return false;
+    }
+
+  bool success = true;
+  char line[512];
+  while (fgets (line, sizeof (line), fh))
+    {
+      char key[BENCH_KEY_SIZE];
+      double ns;
+      if (sscanf (line, " {\"key\": \"%63[^\"]\", \"ns\": %lf", key, &ns) != 2)
+        continue;
+      for (u32 i = 0; i < g_bench.nresults; ++i)
+        {
+          BenchResult *r = &g_bench.results[i];
+          if (strcmp (r->key, key) != 0)
+            continue;
+          double change = (r->ns - ns) / ns;
+          if (change > threshold)
+            {
+              fprintf (stderr, "REGRESSION %s: %.1f ns -> %.1f ns (%+.1f%%)\n",
+                       key, ns, r->ns, 100. * change);
+              success = false;
+            }
+        }
+    }
+
+  fclose (fh);
+  return success;
+}
+
+// The whole of `value' as a finite number
+static bool
+parse_double_arg (const char *value, double *out)
+{
+  // Plain decimals only, no inf or nan that fast math can't tell apart
+  const char *digits = value + (*value == '+' || *value == '-');
+  if (!isdigit ((unsigned char) *digits) && *digits != '.')
+    return false;
+  char *end;
+  errno = 0;
+  double result = strtod (value, &end);
+  if (end == value || *end != '\0' || errno == ERANGE)
+    return false;
+  *out = result;
+  return true;
+}
+
+int
+main (int argc, char **argv)
+{
+  linux_init_platform ();
+
+  const char *out_path = NULL;
+  const char *baseline_path = NULL;
+  double threshold = 0.1;
+  bool bad_usage = false;
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strncmp (argv[i], "--out=", 6) == 0)
+        out_path = argv[i] + 6;
+      else if (strncmp (argv[i], "--baseline=", 11) == 0)
+        baseline_path = argv[i] + 11;
+      else if (strncmp (argv[i], "--threshold=", 12) == 0)
+        bad_usage = (!parse_double_arg (argv[i] + 12, &threshold)
+                     || threshold < 0.);
+      else if (strncmp (argv[i], "--min-time=", 11) == 0)
+        bad_usage = (!parse_double_arg (argv[i] + 11, &g_bench.min_seconds)
+                     || g_bench.min_seconds <= 0.);
+      else if (strcmp (argv[i], "--counters") == 0)
+        g_bench.use_counters = true;
+      else
+        bad_usage = true;
+      if (bad_usage)
+        {
+          fprintf (stderr, "usage: %s [--out=FILE] [--baseline=FILE] "
+                   "[--threshold=0.1] [--min-time=0.2] [--counters]\n",
+                   argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  u64 counters[COUNTER_COUNT];
+  if (g_bench.use_counters && !read_counters (counters))
+    fprintf (stderr, "counters: perf_event_open is not available\n");
+
+  measure_peaks ();
+  fprintf (stderr, "peak %.2f GFLOP/s per thread, GB/s read",
+           g_bench.peak_gflops);
+  for (u32 i = 0; i < BENCH_PEAK_SIZES; ++i)
+    fprintf (stderr, " %" PRIu64 "K %.2f", peak_size (i) / 1024,
+             g_bench.peak_gbs[i]);
+  fprintf (stderr, "\n");
+
+  u32 shapes[][2] = {
+    {30, 10}, {784, 30}, {784, 128}, {1024, 1024}, {4096, 1024}
+  }; // @Hardcode
+  for (u32 i = 0; i < ARRAY_COUNT (shapes); ++i)
+    bench_kernels (shapes[i][0], shapes[i][1]);
+
+  u32 batches[] = {1, 10, 64, 256}; // @Hardcode
+  u32 small[] = {784, 30, 10};
+  u32 deep[] = {784, 256, 128, 10};
+  u32 wide[] = {784, 1024, 10};
+  bench_network (small, ARRAY_COUNT (small), batches, ARRAY_COUNT (batches));
+  bench_network (deep, ARRAY_COUNT (deep), batches, ARRAY_COUNT (batches));
+  bench_network (wide, ARRAY_COUNT (wide), batches, ARRAY_COUNT (batches));
+
+  FILE *out = stdout;
+  if (out_path && !(out = fopen (out_path, "w")))
+    {
+      fprintf (stderr, "%s: cannot open output\n", out_path);
+      return EXIT_FAILURE;
+    }
+  write_results (out);
+  if (out != stdout)
+    fclose (out);
+
+  bool success = true;
+  if (baseline_path)
+    success = compare_with_baseline (baseline_path, threshold);
+
+  clear_memory_pool (&g_bench.mpool);
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,938 @@
+#ifndef LINUX_PLATFORM_H
+#define LINUX_PLATFORM_H 1
+
+// Linux implementation of the PlatformApi, shared by the X11 app and the
+// headless trainer. Needs _GNU_SOURCE defined before any system header.
+
+#include "../types.h"
+#include "../platform.h"
+#include "../memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum
+{
+  LINUX_MEMORY_FLAG_NONE = 0x0,
+} LinuxMemoryBlockFlag;
+
+typedef struct _LinuxMemoryBlock
+{
+  MemoryBlock block;
+  struct _LinuxMemoryBlock *prev;
+  struct _LinuxMemoryBlock *next;
+  flags_t flags;
+} LinuxMemoryBlock;
+
+static MemoryBlock *linux_allocate_memory       (size_t, MemoryBlockFlag);
+static void         linux_deallocate_memory     (MemoryBlock *);
+static WorkQueue   *linux_create_work_queue     (u32, u32);
+static void         linux_destroy_work_queue    (WorkQueue *);
+static void         linux_enqueue_work          (WorkQueue *, WorkQueueCallback,
+                                                 void *, const char *);
+static void         linux_complete_all_work     (WorkQueue *);
+static u32          linux_work_queue_busy_ticks (WorkQueue *, u64 *, u32);
+static Collective  *linux_create_collective     (u32);
+static void         linux_destroy_collective    (Collective *);
+static u32          linux_collective_rank       (Collective *);
+static u32          linux_collective_size       (Collective *);
+static void         linux_allreduce_sum         (Collective *, float *, u32);
+static u64          linux_get_ticks             (void);
+static void         linux_begin_trace           (void);
+static bool         linux_end_trace             (const char *);
+static bool         linux_read_counters         (u64 *);
+static void         linux_set_thread_exit_callback (ThreadExitCallback);
+
+static PlatformApi linux_platform = {
+  .allocate_memory      = linux_allocate_memory,
+  .deallocate_memory    = linux_deallocate_memory,
+  .create_work_queue    = linux_create_work_queue,
+  .destroy_work_queue   = linux_destroy_work_queue,
+  .enqueue_work         = linux_enqueue_work,
+  .complete_all_work    = linux_complete_all_work,
+  .work_queue_busy_ticks = linux_work_queue_busy_ticks,
+  .create_collective    = linux_create_collective,
+  .destroy_collective   = linux_destroy_collective,
+  .collective_rank      = linux_collective_rank,
+  .collective_size      = linux_collective_size,
+  .allreduce_sum        = linux_allreduce_sum,
+  .get_ticks            = linux_get_ticks,
+  .begin_trace          = linux_begin_trace,
+  .end_trace            = linux_end_trace,
+  .read_counters        = linux_read_counters,
+  .set_thread_exit_callback = linux_set_thread_exit_callback,
+  .window = {
+    .width = 800,
+    .height = 600
+  }
+};
+
+PlatformApi *g_platform = &linux_platform;
+
+static LinuxMemoryBlock linux_memory_sentinel = {};
+
+static void
+linux_init_platform ()
+{
+  linux_memory_sentinel.prev = &linux_memory_sentinel;
+  linux_memory_sentinel.next = &linux_memory_sentinel;
+}
+
+static u64
+linux_get_ticks ()
+{
+  u64 ticks;
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  ticks = now.tv_sec;
+  ticks *= TICKS_PER_SECOND;
+  ticks += now.tv_nsec;
+  return ticks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static MemoryBlock *
+linux_allocate_memory (size_t size, MemoryBlockFlag flags)
+{
+  LinuxMemoryBlock *block;
+
+  assert (sizeof (LinuxMemoryBlock) == 64);
+
+  static uintptr_t page_size = 0;
+  if (page_size == 0)
+    page_size = sysconf (_SC_PAGESIZE);
+
+  uintptr_t total_size = size + sizeof (LinuxMemoryBlock);
+  uintptr_t base_offset = sizeof (LinuxMemoryBlock);
+  uintptr_t protect_offset = 0;
+
+  if (flags & MEMORY_BLOCK_FLAG_UNDERFLOW_CHECK)
+    {
+      total_size = size + (2 * page_size);
+      base_offset = 2 * page_size;
+      protect_offset = page_size;
+    }
+  else if (flags & MEMORY_BLOCK_FLAG_OVERFLOW_CHECK)
+    {
+      uintptr_t size_rounded_up = ALIGN_POW2 (size, page_size);
+      total_size = size_rounded_up + (2 * page_size);
+      base_offset = page_size + size_rounded_up - size;
+      protect_offset = page_size + size_rounded_up;
+    }
+
+  block = mmap ((void *) 0, total_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert (block);
+  block->block.base = (u8 *) block + base_offset;
+  assert (block->block.used == 0);
+  assert (block->block.prev == NULL);
+
+  if (flags & (MEMORY_BLOCK_FLAG_UNDERFLOW_CHECK | MEMORY_BLOCK_FLAG_OVERFLOW_CHECK))
+    {
+      int err = mprotect ((u8 *) block + protect_offset, page_size, PROT_NONE);
+      assert (err == 0);
+    }
+
+  block->next = &linux_memory_sentinel;
+  block->block.size = size;
+  block->block.flags = (flags_t) flags;
+  block->flags = LINUX_MEMORY_FLAG_NONE;
+
+  block->prev = linux_memory_sentinel.prev;
+  block->prev->next = block;
+  block->next->prev = block;
+
+  return &block->block;
+}
+
+static void
+linux_deallocate_memory (MemoryBlock *block)
+{
+  LinuxMemoryBlock *linux_block;
+  u64               size;
+  flags_t           flags;
+  uintptr_t         page_size;
+  uintptr_t         total_size;
+
+  if (!block)
+    return;
+
+  size          = block->size;
+  flags         = block->flags;
+  page_size     = sysconf (_SC_PAGESIZE);
+  total_size    = size + sizeof (LinuxMemoryBlock);
+  linux_block   = (LinuxMemoryBlock *) block;
+
+  if (flags & MEMORY_BLOCK_FLAG_UNDERFLOW_CHECK)
+    {
+      total_size = size + (2 * page_size);
+    }
+  else if (flags & MEMORY_BLOCK_FLAG_OVERFLOW_CHECK)
+    {
+      uintptr_t size_rounded_up = ALIGN_POW2 (size, page_size);
+      total_size = size_rounded_up + (2 * page_size);
+    }
+
+  linux_block->prev->next = linux_block->next;
+  linux_block->next->prev = linux_block->prev;
+
+  munmap (linux_block, total_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Work queue tracing. Every thread records into its own ring which only
+// it writes, `linux_end_trace' reads them once the queues are idle and
+// writes Chrome trace JSON for Perfetto or chrome://tracing. Workers give
+// their ring back when they exit, the next new thread records after its
+// events on the same track.
+
+#include <x86intrin.h>
+
+#define LINUX_TRACE_RING_SIZE (256 * 1024) // Events per thread, oldest dropped
+#define LINUX_TRACE_MAX_THREADS 256 // Live threads past this are not traced
+
+typedef enum
+{
+  LINUX_TRACE_JOB,      // A callback ran, its flow from the enqueue ends here
+  LINUX_TRACE_ENQUEUE,
+  LINUX_TRACE_WAIT,     // All of `complete_all_work', jobs run there included
+  LINUX_TRACE_STALL,    // Waiting with nothing left to take from the queue
+  LINUX_TRACE_IDLE      // Worker asleep on the semaphore
+} LinuxTraceKind;
+
+typedef struct
+{
+  const char       *name;
+  u64               start;
+  u64               end;
+  u64               flow;
+  LinuxTraceKind    kind;
+} LinuxTraceEvent;
+
+typedef struct
+{
+  LinuxTraceEvent  *events;
+  u64               count; // Ever recorded, the ring keeps the last ones
+} LinuxTraceRing;
+
+static struct
+{
+  volatile bool     enabled;
+  volatile u32      nrings; // Ever allocated
+  volatile u64      next_flow;
+  u64               origin;
+  LinuxTraceRing    rings[LINUX_TRACE_MAX_THREADS];
+  u32               free_rings[LINUX_TRACE_MAX_THREADS]; // Of exited threads
+  u32               nfree;
+  volatile u32      lock; // Of the free list and `nrings'
+  volatile u32      ndropped; // Threads that found no ring
+} linux_tracer;
+
+static __thread LinuxTraceRing *linux_thread_ring;
+static __thread bool linux_thread_untraced;
+
+static LinuxTraceRing *
+linux_trace_ring ()
+{
+  if (linux_thread_ring || linux_thread_untraced)
+    return linux_thread_ring;
+
+  LinuxTraceRing *ring = NULL;
+  while (__sync_lock_test_and_set (&linux_tracer.lock, 1))
+    _mm_pause ();
+  if (linux_tracer.nfree > 0)
+    ring = &linux_tracer.rings[linux_tracer.free_rings[--linux_tracer.nfree]];
+  else if (linux_tracer.nrings < LINUX_TRACE_MAX_THREADS)
+    {
+      // Kept for the life of the process, the thread may be gone by the
+      // time the trace is written
+      MemoryBlock *block = linux_allocate_memory (sizeof (LinuxTraceEvent)
+                                                  * LINUX_TRACE_RING_SIZE,
+                                                  MEMORY_BLOCK_FLAG_NONE);
+      ring = &linux_tracer.rings[linux_tracer.nrings];
+      ring->events = (LinuxTraceEvent *) block->base;
+      __atomic_store_n (&linux_tracer.nrings, linux_tracer.nrings + 1,
+                        __ATOMIC_RELEASE);
+    }
+  __sync_lock_release (&linux_tracer.lock);
+
+  if (!ring)
+    {
+      if (__sync_fetch_and_add (&linux_tracer.ndropped, 1) == 0)
+        fprintf (stderr, "trace: more than %u threads, the rest are not "
+                 "traced\n", LINUX_TRACE_MAX_THREADS);
+      linux_thread_untraced = true;
+    }
+  linux_thread_ring = ring;
+  return ring;
+}
+
+// On thread exit, the events stay for `linux_end_trace'
+static void
+linux_release_trace_ring ()
+{
+  LinuxTraceRing *ring = linux_thread_ring;
+  if (!ring)
+    return;
+  linux_thread_ring = NULL;
+  while (__sync_lock_test_and_set (&linux_tracer.lock, 1))
+    _mm_pause ();
+  linux_tracer.free_rings[linux_tracer.nfree++]
+    = (u32) (ring - linux_tracer.rings);
+  __sync_lock_release (&linux_tracer.lock);
+}
+
+static void
+linux_record_trace (LinuxTraceKind kind, const char *name, u64 start,
+                    u64 flow)
+{
+  LinuxTraceRing *ring = linux_trace_ring ();
+  if (!ring)
+    return;
+  u64 slot = ring->count++ % LINUX_TRACE_RING_SIZE;
+  ring->events[slot] = (LinuxTraceEvent) {
+    .name   = name,
+    .start  = start,
+    .end    = linux_get_ticks (),
+    .flow   = flow,
+    .kind   = kind
+  };
+}
+
+// Must be called while the work queues are idle
+static void
+linux_begin_trace ()
+{
+  for (u32 i = 0; i < linux_tracer.nrings; ++i)
+    linux_tracer.rings[i].count = 0;
+  linux_tracer.ndropped = 0;
+  linux_tracer.next_flow = 0;
+  linux_tracer.origin = linux_get_ticks ();
+  linux_tracer.enabled = true;
+}
+
+static void
+linux_write_trace_event (FILE *f, pid_t pid, u32 tid, LinuxTraceEvent *event)
+{
+  static const char *names[] = {
+    [LINUX_TRACE_ENQUEUE]   = "enqueue",
+    [LINUX_TRACE_WAIT]      = "complete_all_work",
+    [LINUX_TRACE_STALL]     = "stall",
+    [LINUX_TRACE_IDLE]      = "idle"
+  };
+  double ts = (double) (event->start - linux_tracer.origin) / 1000.;
+  double dur = (double) (event->end - event->start) / 1000.;
+  const char *name = ((event->kind == LINUX_TRACE_JOB)
+                      ? event->name
+                      : names[event->kind]);
+
+  fprintf (f, ",\n{\"ph\": \"X\", \"pid\": %d, \"tid\": %u, "
+           "\"ts\": %.3f, \"dur\": %.3f, \"name\": \"%s\"",
+           (int) pid, tid, ts, dur, name);
+  if (event->kind == LINUX_TRACE_ENQUEUE)
+    fprintf (f, ", \"args\": {\"job\": \"%s\"}", event->name);
+  fprintf (f, "}");
+
+  // Arrows from every enqueue to the thread that ran the job
+  if (event->kind == LINUX_TRACE_ENQUEUE)
+    fprintf (f, ",\n{\"ph\": \"s\", \"pid\": %d, \"tid\": %u, "
+             "\"ts\": %.3f, \"id\": %" PRIu64 ", \"cat\": \"job\", "
+             "\"name\": \"job\"}",
+             (int) pid, tid, ts, event->flow);
+  else if (event->kind == LINUX_TRACE_JOB && event->flow != 0)
+    fprintf (f, ",\n{\"ph\": \"f\", \"bp\": \"e\", \"pid\": %d, "
+             "\"tid\": %u, \"ts\": %.3f, \"id\": %" PRIu64 ", "
+             "\"cat\": \"job\", \"name\": \"job\"}",
+             (int) pid, tid, ts, event->flow);
+}
+
+// Stops recording and writes everything since `linux_begin_trace'
+static bool
+linux_end_trace (const char *path)
+{
+  linux_tracer.enabled = false;
+
+  FILE *f = fopen (path, "w");
+  if (!f)
+    return false;
+
+  pid_t pid = getpid ();
+  fprintf (f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  fprintf (f, "{\"ph\": \"M\", \"pid\": %d, \"name\": \"process_name\", "
+           "\"args\": {\"name\": \"fonograf %d\"}}", (int) pid, (int) pid);
+
+  if (linux_tracer.ndropped > 0)
+    fprintf (stderr, "trace: %u threads past %u at once were not traced\n",
+             linux_tracer.ndropped, LINUX_TRACE_MAX_THREADS);
+  for (u32 i = 0; i < linux_tracer.nrings; ++i)
+    {
+      LinuxTraceRing *ring = &linux_tracer.rings[i];
+      if (ring->count == 0)
+        continue;
+      fprintf (f, ",\n{\"ph\": \"M\", \"pid\": %d, \"tid\": %u, "
+               "\"name\": \"thread_name\", "
+               "\"args\": {\"name\": \"thread %u\"}}", (int) pid, i, i);
+
+      u64 first = 0;
+      if (ring->count > LINUX_TRACE_RING_SIZE)
+        {
+          first = ring->count - LINUX_TRACE_RING_SIZE;
+          fprintf (stderr, "trace: thread %u dropped its first %" PRIu64
+                   " events\n", i, first);
+        }
+      for (u64 j = first; j < ring->count; ++j)
+        linux_write_trace_event (f, pid, i,
+                                 &ring->events[j % LINUX_TRACE_RING_SIZE]);
+    }
+
+  fprintf (f, "\n]}\n");
+  bool success = !ferror (f);
+  success = (fclose (f) == 0) && success;
+  return success;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Hardware counters through perf_event_open, one group per thread opened
+// on first use. User space only, so perf_event_paranoid up to 2 is fine.
+// Events the PMU lacks read as zero, no PMU at all fails the read.
+
+typedef struct
+{
+  pid_t     pid; // Forked children must not read their parent's group
+  int       fds[COUNTER_COUNT];
+  u32       counters[COUNTER_COUNT]; // Of each open fd
+  u32       nopen;
+  bool      failed;
+} LinuxCounters;
+
+static __thread LinuxCounters linux_counters;
+
+static const struct
+{
+  u32 type;
+  u64 config;
+} linux_counter_events[COUNTER_COUNT] = {
+  [COUNTER_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  [COUNTER_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  [COUNTER_LLC_MISSES]    = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  [COUNTER_DTLB_MISSES]   = {PERF_TYPE_HW_CACHE,
+                             PERF_COUNT_HW_CACHE_DTLB
+                             | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+};
+
+static void
+linux_close_counters ()
+{
+  LinuxCounters *counters = &linux_counters;
+  for (u32 i = 0; i < counters->nopen; ++i)
+    close (counters->fds[i]);
+  *counters = (LinuxCounters) {};
+}
+
+static bool
+linux_open_counters ()
+{
+  LinuxCounters *counters = &linux_counters;
+  counters->pid = getpid ();
+  for (u32 i = 0; i < COUNTER_COUNT; ++i)
+    {
+      struct perf_event_attr attr = {
+        .type           = linux_counter_events[i].type,
+        .size           = sizeof (attr),
+        .config         = linux_counter_events[i].config,
+        .disabled       = (counters->nopen == 0),
+        .exclude_kernel = 1,
+        .exclude_hv     = 1,
+        .read_format    = PERF_FORMAT_GROUP
+      };
+      int leader = (counters->nopen > 0) ? counters->fds[0] : -1;
+      int fd = (int) syscall (SYS_perf_event_open, &attr, 0, -1, leader, 0);
+      if (fd < 0)
+        {
+          if (i == COUNTER_CYCLES)
+            return false; // No PMU, the others won't open either
+          continue;
+        }
+      counters->fds[counters->nopen] = fd;
+      counters->counters[counters->nopen] = i;
+      ++counters->nopen;
+    }
+  ioctl (counters->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl (counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+// Free running totals, only differences between two reads mean anything
+static bool
+linux_read_counters (u64 *values)
+{
+  LinuxCounters *counters = &linux_counters;
+  if (counters->pid != 0 && counters->pid != getpid ())
+    linux_close_counters (); // Inherited fds count the parent
+  if (counters->failed)
+    return false;
+  if (counters->nopen == 0 && !linux_open_counters ())
+    {
+      counters->failed = true;
+      return false;
+    }
+
+  u64 group[1 + COUNTER_COUNT];
+  if (read (counters->fds[0], group, sizeof (group)) < (ssize_t) sizeof (u64))
+    return false;
+  memset (values, 0, sizeof (u64) * COUNTER_COUNT);
+  for (u32 i = 0; i < counters->nopen && i < group[0]; ++i)
+    values[counters->counters[i]] = group[1 + i];
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <pthread.h>
+#include <semaphore.h>
+
+typedef struct
+{
+  WorkQueueCallback callback;
+  void *data;
+  const char *name;
+  u64 flow; // Trace id linking the enqueue to the job, 0 when not tracing
+} WorkQueueEntry;
+
+// Time spent running jobs, only written by its own thread
+typedef struct
+{
+  alignas (64) volatile u64 ticks; // Of finished jobs
+  volatile u64 start; // Of the running job, 0 between jobs
+} LinuxWorkerBusy;
+
+struct _WorkQueue
+{
+  MemoryPool mpool;
+  volatile u32 completion_goal;
+  volatile u32 completion_count;
+  volatile u32 next_entry_to_read;
+  volatile u32 next_entry_to_write;
+  volatile bool terminated;
+  sem_t semaphore_handle;
+  struct
+  {
+    WorkQueueEntry *base;
+    u32 nmemb;
+  } entries;
+  struct
+  {
+    pthread_t *base;
+    u32 nmemb;
+  } threads;
+  LinuxWorkerBusy *busy; // The caller of `complete_all_work' first
+  volatile u32 nstarted;
+};
+
+static bool
+linux_do_next_work_queue_entry (WorkQueue *queue, LinuxWorkerBusy *busy)
+{
+    bool should_sleep = false;
+
+    u32 orig_next_entry_to_read = queue->next_entry_to_read;
+    u32 new_next_entry_to_read = (orig_next_entry_to_read + 1) % queue->entries.nmemb;
+
+    if (orig_next_entry_to_read != queue->next_entry_to_write)
+      {
+        u32 index = __sync_val_compare_and_swap (&queue->next_entry_to_read,
+                                                 orig_next_entry_to_read,
+                                                 new_next_entry_to_read);
+        if (index == orig_next_entry_to_read)
+          {
+            WorkQueueEntry entry = queue->entries.base[index];
+            u64 start = linux_get_ticks ();
+            __atomic_store_n (&busy->start, start, __ATOMIC_RELAXED);
+            entry.callback (entry.data);
+            if (linux_tracer.enabled)
+              linux_record_trace (LINUX_TRACE_JOB, entry.name, start,
+                                  entry.flow);
+            __atomic_store_n (&busy->ticks,
+                              busy->ticks + (linux_get_ticks () - start),
+                              __ATOMIC_RELAXED);
+            __atomic_store_n (&busy->start, 0, __ATOMIC_RELAXED);
+            __sync_fetch_and_add (&queue->completion_count, 1);
+          }
+      }
+    else
+      {
+        should_sleep = true;
+      }
+
+    return should_sleep;
+}
+
+static void
+linux_enqueue_work (WorkQueue *queue, WorkQueueCallback callback, void *data,
+                    const char *name)
+{
+    bool tracing = linux_tracer.enabled;
+    u64 start = tracing ? linux_get_ticks () : 0;
+
+    u32 new_next_entry_to_write = (queue->next_entry_to_write + 1) % queue->entries.nmemb;
+    assert (new_next_entry_to_write != queue->next_entry_to_read);
+    WorkQueueEntry *entry = queue->entries.base + queue->next_entry_to_write;
+    entry->callback = callback;
+    entry->data = data;
+    entry->name = name;
+    entry->flow = tracing ? __sync_add_and_fetch (&linux_tracer.next_flow, 1) : 0;
+    ++queue->completion_goal;
+
+    asm volatile("" ::: "memory");
+
+    queue->next_entry_to_write = new_next_entry_to_write;
+    sem_post (&queue->semaphore_handle);
+
+    if (tracing)
+      linux_record_trace (LINUX_TRACE_ENQUEUE, name, start, entry->flow);
+}
+
+static void
+linux_complete_all_work (WorkQueue *queue)
+{
+  bool tracing = linux_tracer.enabled;
+  u64 start = tracing ? linux_get_ticks () : 0;
+  u64 stall_start = 0;
+
+  while (queue->completion_goal != queue->completion_count)
+    {
+      // A stall ends as soon as there is work again, before running it
+      if (stall_start != 0
+          && queue->next_entry_to_read != queue->next_entry_to_write)
+        {
+          linux_record_trace (LINUX_TRACE_STALL, NULL, stall_start, 0);
+          stall_start = 0;
+        }
+      bool stalled = linux_do_next_work_queue_entry (queue, &queue->busy[0]);
+      if (tracing && stalled && stall_start == 0)
+        stall_start = linux_get_ticks ();
+    }
+
+  if (stall_start != 0)
+    linux_record_trace (LINUX_TRACE_STALL, NULL, stall_start, 0);
+  if (tracing)
+    linux_record_trace (LINUX_TRACE_WAIT, NULL, start, 0);
+
+  queue->completion_goal = 0;
+  queue->completion_count = 0;
+}
+
+static ThreadExitCallback linux_thread_exit_callback;
+
+static void
+linux_set_thread_exit_callback (ThreadExitCallback callback)
+{
+  __atomic_store_n (&linux_thread_exit_callback, callback, __ATOMIC_RELEASE);
+}
+
+static void *
+linux_thread_proc (void *user_data)
+{
+  WorkQueue *queue = (WorkQueue *) user_data;
+  LinuxWorkerBusy *busy
+    = &queue->busy[__sync_add_and_fetch (&queue->nstarted, 1)];
+
+  while (!queue->terminated)
+    {
+      if (linux_do_next_work_queue_entry (queue, busy))
+        {
+          bool tracing = linux_tracer.enabled;
+          u64 start = tracing ? linux_get_ticks () : 0;
+          sem_wait (&queue->semaphore_handle);
+          if (tracing)
+            linux_record_trace (LINUX_TRACE_IDLE, NULL, start, 0);
+        }
+    }
+
+  ThreadExitCallback exit_callback
+    = __atomic_load_n (&linux_thread_exit_callback, __ATOMIC_ACQUIRE);
+  if (exit_callback)
+    exit_callback ();
+  linux_release_trace_ring ();
+  linux_close_counters ();
+
+  return NULL;
+}
+
+static WorkQueue *
+linux_create_work_queue (u32 entry_count, u32 thread_count)
+{
+  WorkQueue *queue;
+
+  queue = init_push_struct (WorkQueue, mpool, MEMORY_FLAG_NONE);
+
+  queue->terminated = false;
+
+  queue->completion_goal = 0;
+  queue->completion_count = 0;
+
+  queue->next_entry_to_write = 0;
+  queue->next_entry_to_read = 0;
+
+  sem_init (&queue->semaphore_handle, 0, 0);
+
+  queue->entries.base = push_array (&queue->mpool, WorkQueueEntry, entry_count,
+                                    MEMORY_FLAG_NONE);
+  queue->entries.nmemb = entry_count;
+
+  queue->threads.base = push_array (&queue->mpool, pthread_t, thread_count,
+                                    MEMORY_FLAG_NONE);
+  queue->threads.nmemb = 0;
+
+  queue->busy = push_array (&queue->mpool, LinuxWorkerBusy, thread_count + 1,
+                            MEMORY_FLAG_ZERO);
+  queue->nstarted = 0;
+
+  for (u32 i = 0; i < thread_count; ++i)
+    {
+      pthread_t thread_id;
+      int err = pthread_create (&thread_id, NULL, linux_thread_proc, queue);
+      if (err == 0)
+        queue->threads.base[queue->threads.nmemb++] = thread_id;
+      else
+        fprintf (stderr, "Could not create thread: %s\n", strerror (err));
+    }
+
+  return queue;
+}
+
+// Busy ticks of the calling thread, then of every worker, running jobs
+// included so far. Off by up to a job for a thread finishing one.
+static u32
+linux_work_queue_busy_ticks (WorkQueue *queue, u64 *ticks, u32 max_threads)
+{
+  u64 now = linux_get_ticks ();
+  u32 nthreads = MIN (queue->threads.nmemb + 1, max_threads);
+  for (u32 i = 0; i < nthreads; ++i)
+    {
+      LinuxWorkerBusy *busy = &queue->busy[i];
+      u64 start = __atomic_load_n (&busy->start, __ATOMIC_RELAXED);
+      ticks[i] = __atomic_load_n (&busy->ticks, __ATOMIC_RELAXED);
+      if (start != 0)
+        ticks[i] += now - MIN (start, now);
+    }
+  return nthreads;
+}
+
+static void
+linux_destroy_work_queue (WorkQueue *queue)
+{
+  queue->terminated = true;
+  for (u32 i = 0; i < queue->threads.nmemb; ++i)
+    sem_post (&queue->semaphore_handle);
+  for (u32 i = 0; i < queue->threads.nmemb; ++i)
+    pthread_join (queue->threads.base[i], NULL);
+  clear_memory_pool (&queue->mpool);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include <sched.h>
+#include <sys/wait.h>
+
+#define COLLECTIVE_SLOT_SIZE (64 * 1024) // Floats per rank and round
+
+typedef struct
+{
+  pthread_barrier_t barrier;
+  u32 nranks;
+  alignas (64) float slots[];
+} LinuxCollectiveShared;
+
+struct _Collective
+{
+  MemoryPool mpool;
+  u32 rank;
+  u32 nranks;
+  size_t shared_size;
+  LinuxCollectiveShared *shared;
+  struct
+  {
+    pid_t *base;
+    u32 nmemb;
+  } children;
+};
+
+static bool
+linux_bind_to_numa_node (u32 node)
+{
+  char path[64];
+  snprintf (path, sizeof (path), "/sys/devices/system/node/node%u/cpulist",
+            node);
+  FILE *f = fopen (path, "r");
+  if (!f)
+    return false;
+
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  unsigned int first, last;
+  while (fscanf (f, "%u", &first) == 1)
+    {
+      last = first;
+      if (fscanf (f, "-%u", &last) != 1)
+        last = first;
+      for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        CPU_SET (cpu, &set);
+      if (fgetc (f) != ',')
+        break;
+    }
+  fclose (f);
+
+  // Only affects the calling thread and the threads it creates later
+  return (CPU_COUNT (&set) > 0
+          && sched_setaffinity (0, sizeof (set), &set) == 0);
+}
+
+static u32
+linux_count_numa_nodes ()
+{
+  u32 count = 0;
+  for (;;)
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "/sys/devices/system/node/node%u", count);
+      if (access (path, F_OK) != 0)
+        break;
+      ++count;
+    }
+  return count;
+}
+
+static Collective *
+linux_create_collective (u32 nranks)
+{
+  Collective *collective;
+
+  assert (nranks > 0);
+
+  collective = init_push_struct (Collective, mpool, MEMORY_FLAG_ZERO);
+  collective->rank = 0;
+  collective->nranks = nranks;
+
+  collective->shared_size = (sizeof (LinuxCollectiveShared)
+                             + (sizeof (float) * COLLECTIVE_SLOT_SIZE * nranks));
+  collective->shared = mmap ((void *) 0, collective->shared_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert (collective->shared != MAP_FAILED);
+  collective->shared->nranks = nranks;
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init (&attr);
+  pthread_barrierattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init (&collective->shared->barrier, &attr, nranks);
+  pthread_barrierattr_destroy (&attr);
+
+  collective->children.base = push_array (&collective->mpool, pid_t, nranks,
+                                          MEMORY_FLAG_ZERO);
+  collective->children.nmemb = 0;
+
+  // Don't let the children flush our buffered output a second time
+  fflush (stdout);
+  fflush (stderr);
+
+  for (u32 rank = 1; rank < nranks; ++rank)
+    {
+      pid_t pid = fork ();
+      assert (pid >= 0);
+      if (pid == 0)
+        {
+          collective->rank = rank;
+          collective->children.nmemb = 0;
+          break;
+        }
+      collective->children.base[collective->children.nmemb++] = pid;
+    }
+
+  u32 nnodes = linux_count_numa_nodes ();
+  if (nnodes > 1)
+    linux_bind_to_numa_node (collective->rank % nnodes);
+
+  return collective;
+}
+
+static void
+linux_destroy_collective (Collective *collective)
+{
+  for (u32 i = 0; i < collective->children.nmemb; ++i)
+    waitpid (collective->children.base[i], NULL, 0);
+  if (collective->rank == 0)
+    pthread_barrier_destroy (&collective->shared->barrier);
+  munmap (collective->shared, collective->shared_size);
+  clear_memory_pool (&collective->mpool);
+}
+
+static u32
+linux_collective_rank (Collective *collective)
+{
+  return collective->rank;
+}
+
+static u32
+linux_collective_size (Collective *collective)
+{
+  return collective->nranks;
+}
+
+static void
+linux_allreduce_sum (Collective *collective, float *data, u32 nmemb)
+{
+  LinuxCollectiveShared *shared = collective->shared;
+  u32 rank = collective->rank;
+  u32 nranks = collective->nranks;
+  float *own_slot = shared->slots + (rank * COLLECTIVE_SLOT_SIZE);
+
+  // Reduce-scatter followed by all-gather through the shared slots: every
+  // rank sums its own segment across all slots, then copies every
+  // segment back. Each rank reads and writes (nranks - 1) / nranks of
+  // the data, same as a ring but without the nranks - 1 steps.
+  for (u32 offset = 0; offset < nmemb; offset += COLLECTIVE_SLOT_SIZE)
+    {
+      u32 count = MIN (nmemb - offset, (u32) COLLECTIVE_SLOT_SIZE);
+      u32 segment = (count + nranks - 1) / nranks;
+
+      memcpy (own_slot, data + offset, sizeof (float) * count);
+      pthread_barrier_wait (&shared->barrier);
+
+      u32 begin = MIN (rank * segment, count);
+      u32 end = MIN (begin + segment, count);
+      for (u32 r = 0; r < nranks; ++r)
+        {
+          if (r == rank)
+            continue;
+          float *slot = shared->slots + (r * COLLECTIVE_SLOT_SIZE);
+          for (u32 i = begin; i < end; ++i)
+            own_slot[i] += slot[i];
+        }
+      pthread_barrier_wait (&shared->barrier);
+
+      for (u32 r = 0; r < nranks; ++r)
+        {
+          float *slot = shared->slots + (r * COLLECTIVE_SLOT_SIZE);
+          u32 rbegin = MIN (r * segment, count);
+          u32 rend = MIN (rbegin + segment, count);
+          memcpy (data + offset + rbegin, slot + rbegin,
+                  sizeof (float) * (rend - rbegin));
+        }
+      // Nobody may refill their slot before everyone is done reading
+      pthread_barrier_wait (&shared->barrier);
+    }
+}
+
+#endif /* ! LINUX_PLATFORM_H */
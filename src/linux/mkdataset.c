@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+// Writes a synthetic data set in the IDX format of the MNIST files, for
+// benchmarking without them. Every class is a few gaussian blobs at fixed
+// places, every sample shifts and scales its class and adds speckle, so
+// the set is learnable and mostly zero like handwriting.
+//
+// usage: mkdataset --images=FILE --labels=FILE [--count=60000] [--rows=28]
+//                  [--cols=28] [--classes=10] [--seed=1]
+
+#include "../types.h"
+#include "../platform.h"
+#include "../maths.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DATASET_MAX_CLASSES 10 // What the loader supports
+#define DATASET_BLOBS 4 // Per class
+#define DATASET_MAX_SHIFT 2
+#define DATASET_SPECKLE 0.01f // Probability of a random pixel
+
+typedef struct
+{
+  float x;
+  float y;
+  float radius;
+} Blob;
+
+static void
+fwrite_u32 (FILE *f, u32 value)
+{
+  u8 bytes[4] = {
+    (u8) (value >> 24), (u8) (value >> 16), (u8) (value >> 8), (u8) value
+  };
+  fwrite (bytes, sizeof (bytes), 1, f);
+}
+
+static float
+next_unit (Random *random)
+{
+  float values[4];
+  _mm_storeu_ps (values, random_unit_x4 (random));
+  return values[0];
+}
+
+// The whole of `value' as a decimal or 0x number, no sign
+static bool
+parse_u64_arg (const char *value, u64 *out)
+{
+  if (!isdigit ((unsigned char) *value))
+    return false;
+  char *end;
+  errno = 0;
+  u64 result = strtoull (value, &end, 0);
+  if (*end != '\0' || errno == ERANGE)
+    return false;
+  *out = result;
+  return true;
+}
+
+// A positive u32 after `prefix', false if `arg' is another option
+static bool
+take_count_arg (const char *arg, const char *prefix, u32 *out,
+                bool *bad_usage)
+{
+  size_t length = strlen (prefix);
+  if (strncmp (arg, prefix, length) != 0)
+    return false;
+  u64 value;
+  if (parse_u64_arg (arg + length, &value) && value > 0
+      && value <= (u32) -1)
+    *out = (u32) value;
+  else
+    *bad_usage = true;
+  return true;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *images_path = NULL;
+  const char *labels_path = NULL;
+  u32 count = 60000;
+  u32 rows = 28;
+  u32 cols = 28;
+  u32 nclasses = 10;
+  u64 seed = 1;
+  bool bad_usage = false;
+  for (int i = 1; i < argc && !bad_usage; ++i)
+    {
+      const char *arg = argv[i];
+      if (strncmp (arg, "--images=", 9) == 0)
+        images_path = arg + 9;
+      else if (strncmp (arg, "--labels=", 9) == 0)
+        labels_path = arg + 9;
+      else if (strncmp (arg, "--seed=", 7) == 0)
+        bad_usage = !parse_u64_arg (arg + 7, &seed);
+      else if (take_count_arg (arg, "--count=", &count, &bad_usage)
+               || take_count_arg (arg, "--rows=", &rows, &bad_usage)
+               || take_count_arg (arg, "--cols=", &cols, &bad_usage)
+               || take_count_arg (arg, "--classes=", &nclasses, &bad_usage))
+        continue;
+      else
+        bad_usage = true;
+    }
+  if (bad_usage || !images_path || !labels_path
+      || nclasses > DATASET_MAX_CLASSES)
+    {
+      fprintf (stderr, "usage: %s --images=FILE --labels=FILE [--count=N] "
+               "[--rows=N] [--cols=N] [--classes=N<=%u] [--seed=N]\n",
+               argv[0], DATASET_MAX_CLASSES);
+      return EXIT_FAILURE;
+    }
+
+  FILE *images_fh = fopen (images_path, "w");
+  FILE *labels_fh = fopen (labels_path, "w");
+  if (!images_fh || !labels_fh)
+    {
+      fprintf (stderr, "cannot open %s and %s\n", images_path, labels_path);
+      return EXIT_FAILURE;
+    }
+
+  // On the heap, large images would overflow the stack
+  u64 image_size = (u64) rows * cols;
+  u8 *image = (image_size <= SIZE_MAX) ? malloc (image_size) : NULL;
+  if (!image)
+    {
+      fprintf (stderr, "cannot allocate %ux%u images\n", rows, cols);
+      return EXIT_FAILURE;
+    }
+
+  fwrite_u32 (images_fh, 2051);
+  fwrite_u32 (images_fh, count);
+  fwrite_u32 (images_fh, rows);
+  fwrite_u32 (images_fh, cols);
+  fwrite_u32 (labels_fh, 2049);
+  fwrite_u32 (labels_fh, count);
+
+  Random random;
+  seed_random (&random, seed);
+
+  Blob blobs[DATASET_MAX_CLASSES][DATASET_BLOBS];
+  float scale = (float) MIN (rows, cols);
+  for (u32 c = 0; c < nclasses; ++c)
+    {
+      for (u32 b = 0; b < DATASET_BLOBS; ++b)
+        {
+          blobs[c][b].x = (.2f + .6f * next_unit (&random)) * cols;
+          blobs[c][b].y = (.2f + .6f * next_unit (&random)) * rows;
+          blobs[c][b].radius = (.05f + .07f * next_unit (&random)) * scale;
+        }
+    }
+
+  for (u32 i = 0; i < count; ++i)
+    {
+      u8 label = (u8) (next_unit (&random) * nclasses);
+      float dx = (2.f * next_unit (&random) - 1.f) * DATASET_MAX_SHIFT;
+      float dy = (2.f * next_unit (&random) - 1.f) * DATASET_MAX_SHIFT;
+      float intensity = .6f + .4f * next_unit (&random);
+
+      for (u32 y = 0; y < rows; ++y)
+        {
+          for (u32 x = 0; x < cols; ++x)
+            {
+              float value = 0.f;
+              for (u32 b = 0; b < DATASET_BLOBS; ++b)
+                {
+                  Blob *blob = &blobs[label][b];
+                  float ox = x - (blob->x + dx);
+                  float oy = y - (blob->y + dy);
+                  float r2 = blob->radius * blob->radius;
+                  float d2 = (ox * ox) + (oy * oy);
+                  if (d2 < 4.f * r2)
+                    value += powf (M_E, -d2 / r2);
+                }
+              if (next_unit (&random) < DATASET_SPECKLE)
+                value += next_unit (&random);
+              value = MIN (value * intensity, 1.f);
+              image[((u64) y * cols) + x] = (u8) (value * 255.f);
+            }
+        }
+
+      fwrite (image, image_size, 1, images_fh);
+      fwrite (&label, sizeof (label), 1, labels_fh);
+    }
+
+  free (image);
+  bool success = !ferror (images_fh) && !ferror (labels_fh);
+  success = (fclose (images_fh) == 0) && success;
+  success = (fclose (labels_fh) == 0) && success;
+  if (!success)
+    {
+      fprintf (stderr, "failed writing %s and %s\n", images_path, labels_path);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
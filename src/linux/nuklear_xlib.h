@@ -15,6 +15,12 @@
 
 #include <X11/Xlib.h>
 
+/* Define NK_XLIB_USE_XSHM and link libXext to rasterize into a client side
+ * framebuffer in shared memory, presented with one XShmPutImage a frame
+ * instead of an X request for every command. Displays without MIT-SHM,
+ * like remote ones, or that are not 24 bit true colour keep drawing to
+ * the server side pixmap. */
+
 typedef struct XFont XFont;
 NK_API struct nk_context*   nk_xlib_init(XFont*, Display*, int scrn, Window root, unsigned w, unsigned h);
 NK_API int                  nk_xlib_handle_event(Display*, int scrn, Window, XEvent*);
@@ -26,6 +32,9 @@ NK_API void                 nk_xlib_paste(nk_handle, struct nk_text_edit*);
 NK_API void                 nk_xlib_copy(nk_handle, const char*, int len);
 
 /* Image */
+NK_API struct nk_image      nk_xsurf_create_image(unsigned w, unsigned h);
+NK_API nk_uint*             nk_xsurf_image_pixels(struct nk_image);
+NK_API void                 nk_xsurf_image_free(struct nk_image*);
 #ifdef NK_XLIB_INCLUDE_STB_IMAGE
 NK_API struct nk_image nk_xsurf_load_image_from_file(char const *filename);
 NK_API struct nk_image nk_xsurf_load_image_from_memory(const void *membuf, nk_uint membufSize);
@@ -54,6 +63,12 @@ NK_API void                 nk_xfont_del(Display *dpy, XFont *font);
 #include <unistd.h>
 #include <time.h>
 
+#ifdef NK_XLIB_USE_XSHM
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
+
 
 #ifdef NK_XLIB_IMPLEMENT_STB_IMAGE
 #define STB_IMAGE_IMPLEMENTATION
@@ -71,6 +86,11 @@ NK_API void                 nk_xfont_del(Display *dpy, XFont *font);
 #define NK_X11_DOUBLE_CLICK_HI 200
 #endif
 
+#ifdef NK_XLIB_USE_XSHM
+#define NK_XSHM_GLYPH_FIRST 32
+#define NK_XSHM_GLYPH_COUNT 95
+#endif
+
 typedef struct XSurface XSurface;
 typedef struct XImageWithAlpha XImageWithAlpha;
 struct XFont {
@@ -80,6 +100,13 @@ struct XFont {
     XFontSet set;
     XFontStruct *xfont;
     struct nk_user_font handle;
+#ifdef NK_XLIB_USE_XSHM
+    /* printable ASCII side by side, rendered on first use */
+    unsigned char *glyphs;
+    int glyphs_width;
+    int glyph_x[NK_XSHM_GLYPH_COUNT];
+    int glyph_w[NK_XSHM_GLYPH_COUNT];
+#endif
 };
 struct XSurface {
     GC gc;
@@ -88,6 +115,12 @@ struct XSurface {
     Window root;
     Drawable drawable;
     unsigned int w, h;
+#ifdef NK_XLIB_USE_XSHM
+    XImage *fb; /* NULL when drawing to the pixmap */
+    XShmSegmentInfo shm;
+    int presented; /* the server may still be reading fb */
+    int clip_x0, clip_y0, clip_x1, clip_y1;
+#endif
 };
 struct XImageWithAlpha {
     XImage* ximage;
@@ -130,6 +163,77 @@ nk_color_from_byte(const nk_byte *c)
     return (res);
 }
 
+#ifdef NK_XLIB_USE_XSHM
+static int nk_xshm_error;
+
+NK_INTERN int
+nk_xshm_error_handler(Display *dpy, XErrorEvent *evt)
+{
+    NK_UNUSED(dpy);
+    NK_UNUSED(evt);
+    nk_xshm_error = 1;
+    return 0;
+}
+
+NK_INTERN int
+nk_xshm_create(XSurface *surf, unsigned int w, unsigned int h)
+{
+    int (*handler)(Display*, XErrorEvent*);
+    Visual *visual = DefaultVisual(surf->dpy, surf->screen);
+    int depth = DefaultDepth(surf->dpy, surf->screen);
+    XImage *fb;
+
+    if (!XShmQueryExtension(surf->dpy)) return 0;
+    if (visual->class != TrueColor || depth < 24) return 0;
+    fb = XShmCreateImage(surf->dpy, visual, (unsigned int)depth, ZPixmap,
+        NULL, &surf->shm, w, h);
+    if (!fb) return 0;
+    if (fb->bits_per_pixel != 32) {XDestroyImage(fb); return 0;}
+
+    surf->shm.shmid = shmget(IPC_PRIVATE, (size_t)fb->bytes_per_line * h,
+        IPC_CREAT | 0600);
+    if (surf->shm.shmid < 0) {XDestroyImage(fb); return 0;}
+    surf->shm.shmaddr = fb->data = (char*)shmat(surf->shm.shmid, NULL, 0);
+    surf->shm.readOnly = False;
+    if (surf->shm.shmaddr == (char*)-1) {
+        shmctl(surf->shm.shmid, IPC_RMID, NULL);
+        fb->data = NULL;
+        XDestroyImage(fb);
+        return 0;
+    }
+
+    /* a remote server fails the attach, and only says so with an error */
+    nk_xshm_error = 0;
+    handler = XSetErrorHandler(nk_xshm_error_handler);
+    XShmAttach(surf->dpy, &surf->shm);
+    XSync(surf->dpy, False);
+    XSetErrorHandler(handler);
+    /* goes away once both sides have detached */
+    shmctl(surf->shm.shmid, IPC_RMID, NULL);
+    if (nk_xshm_error) {
+        shmdt(surf->shm.shmaddr);
+        fb->data = NULL;
+        XDestroyImage(fb);
+        return 0;
+    }
+    surf->fb = fb;
+    surf->presented = 0;
+    return 1;
+}
+
+NK_INTERN void
+nk_xshm_destroy(XSurface *surf)
+{
+    if (!surf->fb) return;
+    XShmDetach(surf->dpy, &surf->shm);
+    XSync(surf->dpy, False);
+    shmdt(surf->shm.shmaddr);
+    surf->fb->data = NULL;
+    XDestroyImage(surf->fb);
+    surf->fb = NULL;
+}
+#endif /* NK_XLIB_USE_XSHM */
+
 NK_INTERN XSurface*
 nk_xsurf_create(int screen, unsigned int w, unsigned int h)
 {
@@ -141,6 +245,9 @@ nk_xsurf_create(int screen, unsigned int w, unsigned int h)
     surface->root = xlib.root;
     surface->gc = XCreateGC(xlib.dpy, xlib.root, 0, NULL);
     XSetLineAttributes(xlib.dpy, surface->gc, 1, LineSolid, CapButt, JoinMiter);
+#ifdef NK_XLIB_USE_XSHM
+    if (nk_xshm_create(surface, w, h)) return surface;
+#endif
     surface->drawable = XCreatePixmap(xlib.dpy, xlib.root, w, h,
         (unsigned int)DefaultDepth(xlib.dpy, screen));
     return surface;
@@ -152,6 +259,12 @@ nk_xsurf_resize(XSurface *surf, unsigned int w, unsigned int h)
     if(!surf) return;
     if (surf->w == w && surf->h == h) return;
     surf->w = w; surf->h = h;
+#ifdef NK_XLIB_USE_XSHM
+    if (surf->fb) {
+        nk_xshm_destroy(surf);
+        if (nk_xshm_create(surf, w, h)) return;
+    }
+#endif
     if(surf->drawable) XFreePixmap(surf->dpy, surf->drawable);
     surf->drawable = XCreatePixmap(surf->dpy, surf->root, w, h,
         (unsigned int)DefaultDepth(surf->dpy, surf->screen));
@@ -442,7 +555,7 @@ nk_stbi_image_to_xsurf(unsigned char *data, int width, int height, int channels)
 
     if (channels == 4){
         const unsigned alpha_treshold = 127;        
-        aimage->clipMask = XCreatePixmap(surf->dpy, surf->drawable, width, height, 1);
+        aimage->clipMask = XCreatePixmap(surf->dpy, surf->root, width, height, 1);
         
         if( aimage->clipMask ){
             aimage->clipMaskGC = XCreateGC(surf->dpy, aimage->clipMask, 0, 0);
@@ -499,25 +612,73 @@ nk_xsurf_draw_image(XSurface *surf, short x, short y, unsigned short w, unsigned
     XImageWithAlpha *aimage = img.handle.ptr;
     NK_UNUSED(col);
     if (aimage){
+        /* never past the image, XPutImage fails on that */
+        w = (unsigned short)NK_MIN(w, (unsigned short)aimage->ximage->width);
+        h = (unsigned short)NK_MIN(h, (unsigned short)aimage->ximage->height);
         if (aimage->clipMask){
             XSetClipMask(surf->dpy, surf->gc, aimage->clipMask);
             XSetClipOrigin(surf->dpy, surf->gc, x, y); 
         }
         XPutImage(surf->dpy, surf->drawable, surf->gc, aimage->ximage, 0, 0, x, y, w, h);
-        XSetClipMask(surf->dpy, surf->gc, None);
+        /* keeps the scissor of images without alpha */
+        if (aimage->clipMask)
+            XSetClipMask(surf->dpy, surf->gc, None);
+    }
+}
+
+/* A w*h image without alpha for the caller to fill with 0x00RRGGBB
+ * pixels, rows of w. Assumes a 24 or 32 bit true colour screen. */
+NK_API struct nk_image
+nk_xsurf_create_image(unsigned w, unsigned h)
+{
+    XSurface *surf = xlib.surf;
+    struct nk_image img;
+    XImageWithAlpha *aimage;
+    char *data;
+    if (w == 0 || h == 0) return nk_image_id(0);
+    aimage = (XImageWithAlpha*)calloc(1, sizeof(XImageWithAlpha));
+    data = (char*)calloc((size_t)w * h, 4);
+    if (!aimage || !data){
+        free(aimage);
+        free(data);
+        return nk_image_id(0);
+    }
+    aimage->ximage = XCreateImage(surf->dpy,
+           DefaultVisual(surf->dpy, surf->screen),
+           DefaultDepth(surf->dpy, surf->screen),
+           ZPixmap, 0, data, w, h, 32, 4 * w);
+    if (!aimage->ximage){
+        free(aimage);
+        free(data);
+        return nk_image_id(0);
     }
+    img = nk_image_ptr((void*)aimage);
+    img.w = (unsigned short)w;
+    img.h = (unsigned short)h;
+    return img;
 }
 
-void
+NK_API nk_uint*
+nk_xsurf_image_pixels(struct nk_image img)
+{
+    XImageWithAlpha *aimage = img.handle.ptr;
+    if (!aimage) return 0;
+    return (nk_uint*)aimage->ximage->data;
+}
+
+NK_API void
 nk_xsurf_image_free(struct nk_image* image)
 {
     XSurface *surf = xlib.surf;
     XImageWithAlpha *aimage = image->handle.ptr;
     if (!aimage) return;
     XDestroyImage(aimage->ximage);
-    XFreePixmap(surf->dpy, aimage->clipMask);
-    XFreeGC(surf->dpy, aimage->clipMaskGC);
+    if (aimage->clipMask){
+        XFreePixmap(surf->dpy, aimage->clipMask);
+        XFreeGC(surf->dpy, aimage->clipMaskGC);
+    }
     free(aimage);
+    image->handle.ptr = 0;
 }
 
 
@@ -537,7 +698,10 @@ nk_xsurf_blit(Drawable target, XSurface *surf, unsigned int w, unsigned int h)
 NK_INTERN void
 nk_xsurf_del(XSurface *surf)
 {
-    XFreePixmap(surf->dpy, surf->drawable);
+#ifdef NK_XLIB_USE_XSHM
+    nk_xshm_destroy(surf);
+#endif
+    if (surf->drawable) XFreePixmap(surf->dpy, surf->drawable);
     XFreeGC(surf->dpy, surf->gc);
     free(surf);
 }
@@ -603,6 +767,9 @@ nk_xfont_del(Display *dpy, XFont *font)
         XFreeFontSet(dpy, font->set);
     else
         XFreeFont(dpy, font->xfont);
+#ifdef NK_XLIB_USE_XSHM
+    free(font->glyphs);
+#endif
     free(font);
 }
 
@@ -862,6 +1029,492 @@ nk_xlib_handle_event(Display *dpy, int screen, Window win, XEvent *evt)
     return 0;
 }
 
+#ifdef NK_XLIB_USE_XSHM
+/*
+ * Framebuffer rasterizer. Pixels are 0x00RRGGBB, colours ignore alpha
+ * like the Xlib calls do, and every shape is filled with horizontal spans
+ * clipped to the scissor.
+ */
+#define NK_XSHM_ROW(surf, y) ((nk_uint*)((surf)->fb->data + (long)(y) * (surf)->fb->bytes_per_line))
+
+NK_INTERN void
+nk_xshm_span(XSurface *surf, int y, int x0, int x1, nk_uint c)
+{
+    nk_uint *row;
+    if (y < surf->clip_y0 || y >= surf->clip_y1) return;
+    x0 = NK_MAX(x0, surf->clip_x0);
+    x1 = NK_MIN(x1, surf->clip_x1);
+    row = NK_XSHM_ROW(surf, y);
+    while (x0 < x1) row[x0++] = c;
+}
+
+NK_INTERN void
+nk_xshm_scissor(XSurface *surf, float x, float y, float w, float h)
+{
+    /* with the slack of nk_xsurf_scissor */
+    surf->clip_x0 = NK_MAX((int)(x-1), 0);
+    surf->clip_y0 = NK_MAX((int)(y-1), 0);
+    surf->clip_x1 = NK_MIN((int)(x-1) + (int)(w+2), (int)surf->w);
+    surf->clip_y1 = NK_MIN((int)(y-1) + (int)(h+2), (int)surf->h);
+}
+
+NK_INTERN void
+nk_xshm_clear(XSurface *surf, nk_uint c)
+{
+    int y;
+    surf->clip_x0 = surf->clip_y0 = 0;
+    surf->clip_x1 = (int)surf->w;
+    surf->clip_y1 = (int)surf->h;
+    for (y = 0; y < (int)surf->h; ++y)
+        nk_xshm_span(surf, y, 0, (int)surf->w, c);
+}
+
+/* How far row `row' of a box `h' high is cut in by corners of radius r */
+NK_INTERN int
+nk_xshm_corner_inset(int row, int h, int r)
+{
+    float d;
+    if (r <= 0) return 0;
+    if (row < r) d = (float)(r - row) - 0.5f;
+    else if (row >= h - r) d = (float)(row - (h - r)) + 0.5f;
+    else return 0;
+    if (d >= (float)r) return r;
+    return (int)((float)r - NK_SQRT((float)(r*r) - d*d) + 0.5f);
+}
+
+/* Half the width of an ellipse with half axes a and b, dy off its centre */
+NK_INTERN float
+nk_xshm_ellipse_half(float a, float b, float dy)
+{
+    if (a <= 0 || b <= 0 || dy*dy >= b*b) return 0;
+    return a * NK_SQRT(1.0f - (dy*dy)/(b*b));
+}
+
+NK_INTERN void
+nk_xshm_fill_rect(XSurface *surf, short x, short y, unsigned short w,
+    unsigned short h, unsigned short r, struct nk_color col)
+{
+    nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+    int i = NK_MAX(surf->clip_y0 - y, 0);
+    int end = NK_MIN(surf->clip_y1 - y, (int)h);
+    r = NK_MIN(r, NK_MIN(w, h) / 2);
+    for (; i < end; ++i) {
+        int inset = nk_xshm_corner_inset(i, h, r);
+        nk_xshm_span(surf, y + i, x + inset, x + w - inset, c);
+    }
+}
+
+NK_INTERN void
+nk_xshm_stroke_rect(XSurface *surf, short x, short y, unsigned short w,
+    unsigned short h, unsigned short r, unsigned short line_thickness, struct nk_color col)
+{
+    /* XDrawRectangle lines run through x+w, so the box is one wider */
+    nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+    int t = NK_MAX((int)line_thickness, 1);
+    int ox = x - (t-1)/2, oy = y - (t-1)/2;
+    int ow = w + t, oh = h + t;
+    int iw = ow - 2*t, ih = oh - 2*t;
+    int orad = NK_MIN((int)r, NK_MIN(ow, oh) / 2);
+    int irad = NK_MAX(orad - t, 0);
+    int i = NK_MAX(surf->clip_y0 - oy, 0);
+    int end = NK_MIN(surf->clip_y1 - oy, oh);
+    for (; i < end; ++i) {
+        int outer = nk_xshm_corner_inset(i, oh, orad);
+        if (iw > 0 && ih > 0 && i >= t && i < oh - t) {
+            int inner = nk_xshm_corner_inset(i - t, ih, irad);
+            nk_xshm_span(surf, oy + i, ox + outer, ox + t + inner, c);
+            nk_xshm_span(surf, oy + i, ox + t + iw - inner, ox + ow - outer, c);
+        } else nk_xshm_span(surf, oy + i, ox + outer, ox + ow - outer, c);
+    }
+}
+
+NK_INTERN void
+nk_xshm_fill_circle(XSurface *surf, short x, short y, unsigned short w,
+    unsigned short h, struct nk_color col)
+{
+    nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+    float a = w / 2.0f, b = h / 2.0f;
+    float cx = x + a, cy = y + b;
+    int i = NK_MAX(surf->clip_y0 - y, 0);
+    int end = NK_MIN(surf->clip_y1 - y, (int)h);
+    for (; i < end; ++i) {
+        float half = nk_xshm_ellipse_half(a, b, (float)(y + i) + 0.5f - cy);
+        nk_xshm_span(surf, y + i, (int)(cx - half + 0.5f), (int)(cx + half + 0.5f), c);
+    }
+}
+
+NK_INTERN void
+nk_xshm_stroke_circle(XSurface *surf, short x, short y, unsigned short w,
+    unsigned short h, unsigned short line_thickness, struct nk_color col)
+{
+    nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+    float t = (float)NK_MAX((int)line_thickness, 1);
+    float cx = x + w / 2.0f, cy = y + h / 2.0f;
+    float oa = (w + t) / 2.0f, ob = (h + t) / 2.0f;
+    float ia = (w - t) / 2.0f, ib = (h - t) / 2.0f;
+    int top = (int)(cy - ob), bottom = (int)(cy + ob + 1.0f);
+    int py = NK_MAX(top, surf->clip_y0);
+    int end = NK_MIN(bottom, surf->clip_y1);
+    for (; py < end; ++py) {
+        float dy = (float)py + 0.5f - cy;
+        float outer = nk_xshm_ellipse_half(oa, ob, dy);
+        float inner = nk_xshm_ellipse_half(ia, ib, dy);
+        int x0 = (int)(cx - outer + 0.5f), x1 = (int)(cx + outer + 0.5f);
+        if (inner > 0) {
+            nk_xshm_span(surf, py, x0, (int)(cx - inner + 0.5f), c);
+            nk_xshm_span(surf, py, (int)(cx + inner + 0.5f), x1, c);
+        } else nk_xshm_span(surf, py, x0, x1, c);
+    }
+}
+
+NK_INTERN void
+nk_xshm_fill_polygon(XSurface *surf, const struct nk_vec2i *pnts, int count,
+    struct nk_color col)
+{
+    #define MAX_POINTS 128
+    int xs[MAX_POINTS];
+    nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+    int i, j, py, top, bottom;
+    if (count < 3) return;
+    count = NK_MIN(count, MAX_POINTS);
+    top = bottom = pnts[0].y;
+    for (i = 1; i < count; ++i) {
+        top = NK_MIN(top, pnts[i].y);
+        bottom = NK_MAX(bottom, pnts[i].y);
+    }
+    top = NK_MAX(top, surf->clip_y0);
+    bottom = NK_MIN(bottom, surf->clip_y1);
+    /* even-odd over the pixel centres of each row */
+    for (py = top; py < bottom; ++py) {
+        float sy = (float)py + 0.5f;
+        int n = 0;
+        for (i = 0, j = count - 1; i < count; j = i++) {
+            float y0 = pnts[j].y, y1 = pnts[i].y;
+            if ((y0 <= sy) != (y1 <= sy)) {
+                float t = (sy - y0) / (y1 - y0);
+                xs[n++] = (int)(pnts[j].x + t * (float)(pnts[i].x - pnts[j].x) + 0.5f);
+            }
+        }
+        for (i = 1; i < n; ++i) {
+            int v = xs[i];
+            for (j = i; j > 0 && xs[j-1] > v; --j) xs[j] = xs[j-1];
+            xs[j] = v;
+        }
+        for (i = 0; i + 1 < n; i += 2)
+            nk_xshm_span(surf, py, xs[i], xs[i+1], c);
+    }
+    #undef MAX_POINTS
+}
+
+NK_INTERN void
+nk_xshm_fill_triangle(XSurface *surf, short x0, short y0, short x1,
+    short y1, short x2, short y2, struct nk_color col)
+{
+    struct nk_vec2i pnts[3];
+    pnts[0].x = x0; pnts[0].y = y0;
+    pnts[1].x = x1; pnts[1].y = y1;
+    pnts[2].x = x2; pnts[2].y = y2;
+    nk_xshm_fill_polygon(surf, pnts, 3, col);
+}
+
+NK_INTERN void
+nk_xshm_stroke_line(XSurface *surf, short x0, short y0, short x1,
+    short y1, unsigned int line_thickness, struct nk_color col)
+{
+    if (line_thickness <= 1) {
+        /* Bresenham, both ends included like XDrawLine */
+        nk_uint c = (nk_uint)nk_color_from_byte(&col.r);
+        int dx = NK_ABS(x1 - x0), sx = (x0 < x1) ? 1 : -1;
+        int dy = -NK_ABS(y1 - y0), sy = (y0 < y1) ? 1 : -1;
+        int err = dx + dy, x = x0, y = y0;
+        for (;;) {
+            int e2 = 2 * err;
+            nk_xshm_span(surf, y, x, x + 1, c);
+            if (x == x1 && y == y1) break;
+            if (e2 >= dy) {err += dy; x += sx;}
+            if (e2 <= dx) {err += dx; y += sy;}
+        }
+    } else {
+        /* a quad as wide as the line around it */
+        struct nk_vec2i q[4];
+        float dx = (float)(x1 - x0), dy = (float)(y1 - y0);
+        float len = NK_SQRT(dx*dx + dy*dy);
+        float nx, ny;
+        if (len <= 0) return;
+        nx = -dy / len * (float)line_thickness * 0.5f;
+        ny = dx / len * (float)line_thickness * 0.5f;
+        q[0].x = (short)(x0 + nx); q[0].y = (short)(y0 + ny);
+        q[1].x = (short)(x1 + nx); q[1].y = (short)(y1 + ny);
+        q[2].x = (short)(x1 - nx); q[2].y = (short)(y1 - ny);
+        q[3].x = (short)(x0 - nx); q[3].y = (short)(y0 - ny);
+        nk_xshm_fill_polygon(surf, q, 4, col);
+    }
+}
+
+NK_INTERN void
+nk_xshm_stroke_triangle(XSurface *surf, short x0, short y0, short x1,
+    short y1, short x2, short y2, unsigned short line_thickness, struct nk_color col)
+{
+    nk_xshm_stroke_line(surf, x0, y0, x1, y1, line_thickness, col);
+    nk_xshm_stroke_line(surf, x1, y1, x2, y2, line_thickness, col);
+    nk_xshm_stroke_line(surf, x2, y2, x0, y0, line_thickness, col);
+}
+
+NK_INTERN void
+nk_xshm_stroke_polygon(XSurface *surf, const struct nk_vec2i *pnts, int count,
+    unsigned short line_thickness, struct nk_color col)
+{
+    int i;
+    if (count < 1) return;
+    for (i = 1; i < count; ++i)
+        nk_xshm_stroke_line(surf, pnts[i-1].x, pnts[i-1].y, pnts[i].x, pnts[i].y, line_thickness, col);
+    nk_xshm_stroke_line(surf, pnts[count-1].x, pnts[count-1].y, pnts[0].x, pnts[0].y, line_thickness, col);
+}
+
+NK_INTERN void
+nk_xshm_stroke_polyline(XSurface *surf, const struct nk_vec2i *pnts,
+    int count, unsigned short line_thickness, struct nk_color col)
+{
+    int i;
+    for (i = 0; i < count-1; ++i)
+        nk_xshm_stroke_line(surf, pnts[i].x, pnts[i].y, pnts[i+1].x, pnts[i+1].y, line_thickness, col);
+}
+
+NK_INTERN void
+nk_xshm_stroke_curve(XSurface *surf, struct nk_vec2i p1,
+    struct nk_vec2i p2, struct nk_vec2i p3, struct nk_vec2i p4,
+    unsigned int num_segments, unsigned short line_thickness, struct nk_color col)
+{
+    unsigned int i_step;
+    float t_step;
+    struct nk_vec2i last = p1;
+
+    num_segments = NK_MAX(num_segments, 1);
+    t_step = 1.0f/(float)num_segments;
+    for (i_step = 1; i_step <= num_segments; ++i_step) {
+        float t = t_step * (float)i_step;
+        float u = 1.0f - t;
+        float w1 = u*u*u;
+        float w2 = 3*u*u*t;
+        float w3 = 3*u*t*t;
+        float w4 = t * t *t;
+        float x = w1 * p1.x + w2 * p2.x + w3 * p3.x + w4 * p4.x;
+        float y = w1 * p1.y + w2 * p2.y + w3 * p3.y + w4 * p4.y;
+        nk_xshm_stroke_line(surf, last.x, last.y, (short)x, (short)y, line_thickness, col);
+        last.x = (short)x; last.y = (short)y;
+    }
+}
+
+/* Core fonts are rendered by the server, so draw the glyphs into a bitmap
+ * once and read them back */
+NK_INTERN int
+nk_xshm_load_glyphs(XSurface *surf, XFont *font)
+{
+    char text[NK_XSHM_GLYPH_COUNT];
+    int i, x, y, width = 0;
+    Pixmap pixmap;
+    XImage *image;
+    GC gc;
+
+    for (i = 0; i < NK_XSHM_GLYPH_COUNT; ++i) {
+        text[i] = (char)(NK_XSHM_GLYPH_FIRST + i);
+        font->glyph_x[i] = width;
+        font->glyph_w[i] = (int)nk_xfont_get_text_width(nk_handle_ptr(font), 0, &text[i], 1);
+        width += font->glyph_w[i];
+    }
+    if (width <= 0 || font->height <= 0) return 0;
+
+    pixmap = XCreatePixmap(surf->dpy, surf->root, (unsigned)width, (unsigned)font->height, 1);
+    gc = XCreateGC(surf->dpy, pixmap, 0, NULL);
+    XSetForeground(surf->dpy, gc, 0);
+    XFillRectangle(surf->dpy, pixmap, gc, 0, 0, (unsigned)width, (unsigned)font->height);
+    XSetForeground(surf->dpy, gc, 1);
+    if (!font->set) XSetFont(surf->dpy, gc, font->xfont->fid);
+    for (i = 0; i < NK_XSHM_GLYPH_COUNT; ++i) {
+        if (font->set)
+            XmbDrawString(surf->dpy, pixmap, font->set, gc, font->glyph_x[i], font->ascent, &text[i], 1);
+        else XDrawString(surf->dpy, pixmap, gc, font->glyph_x[i], font->ascent, &text[i], 1);
+    }
+    image = XGetImage(surf->dpy, pixmap, 0, 0, (unsigned)width, (unsigned)font->height, 1, XYPixmap);
+    XFreeGC(surf->dpy, gc);
+    XFreePixmap(surf->dpy, pixmap);
+    if (!image) return 0;
+
+    font->glyphs = (unsigned char*)calloc((size_t)width * font->height, 1);
+    if (font->glyphs) {
+        for (y = 0; y < font->height; ++y)
+            for (x = 0; x < width; ++x)
+                font->glyphs[y * width + x] = XGetPixel(image, x, y) != 0;
+        font->glyphs_width = width;
+    }
+    XDestroyImage(image);
+    return font->glyphs != 0;
+}
+
+NK_INTERN void
+nk_xshm_draw_glyph(XSurface *surf, XFont *font, int glyph, int x, int y, nk_uint c)
+{
+    int row = NK_MAX(surf->clip_y0 - y, 0);
+    int end = NK_MIN(surf->clip_y1 - y, font->height);
+    int col0 = NK_MAX(surf->clip_x0 - x, 0);
+    int col1 = NK_MIN(surf->clip_x1 - x, font->glyph_w[glyph]);
+    for (; row < end; ++row) {
+        const unsigned char *src = font->glyphs + row * font->glyphs_width + font->glyph_x[glyph];
+        nk_uint *dst = NK_XSHM_ROW(surf, y + row) + x;
+        int col;
+        for (col = col0; col < col1; ++col)
+            if (src[col]) dst[col] = c;
+    }
+}
+
+NK_INTERN void
+nk_xshm_draw_text(XSurface *surf, short x, short y, unsigned short w, unsigned short h,
+    const char *text, int len, XFont *font, struct nk_color cbg, struct nk_color cfg)
+{
+    nk_uint fg = (nk_uint)nk_color_from_byte(&cfg.r);
+    int i, tx = x;
+
+    nk_xshm_fill_rect(surf, x, y, w, h, 0, cbg);
+    if(!text || !font || !len) return;
+    if (!font->glyphs && !nk_xshm_load_glyphs(surf, font)) return;
+
+    /* anything past ASCII is one '?' a character */
+    for (i = 0; i < len; ++i) {
+        unsigned char ch = (unsigned char)text[i];
+        int glyph = ch - NK_XSHM_GLYPH_FIRST;
+        if ((ch & 0xC0) == 0x80) continue;
+        if (glyph < 0 || glyph >= NK_XSHM_GLYPH_COUNT)
+            glyph = '?' - NK_XSHM_GLYPH_FIRST;
+        nk_xshm_draw_glyph(surf, font, glyph, tx, y, fg);
+        tx += font->glyph_w[glyph];
+    }
+}
+
+NK_INTERN void
+nk_xshm_draw_image(XSurface *surf, short x, short y, unsigned short w, unsigned short h,
+    struct nk_image img, struct nk_color col)
+{
+    /* the alpha masks of stb images are not applied */
+    XImageWithAlpha *aimage = img.handle.ptr;
+    XImage *src;
+    int x0, x1, y0, y1, py, px;
+    NK_UNUSED(col);
+    if (!aimage) return;
+    src = aimage->ximage;
+    x0 = NK_MAX((int)x, surf->clip_x0);
+    y0 = NK_MAX((int)y, surf->clip_y0);
+    x1 = NK_MIN(x + NK_MIN((int)w, src->width), surf->clip_x1);
+    y1 = NK_MIN(y + NK_MIN((int)h, src->height), surf->clip_y1);
+    if (x0 >= x1) return;
+    for (py = y0; py < y1; ++py) {
+        nk_uint *dst = NK_XSHM_ROW(surf, py);
+        if (src->bits_per_pixel == 32) {
+            NK_MEMCPY(dst + x0, src->data + (long)(py - y) * src->bytes_per_line
+                + (long)(x0 - x) * 4, (nk_size)(x1 - x0) * 4);
+        } else {
+            for (px = x0; px < x1; ++px)
+                dst[px] = (nk_uint)XGetPixel(src, px - x, py - y);
+        }
+    }
+}
+
+NK_INTERN void
+nk_xshm_render(Drawable screen, XSurface *surf, struct nk_color clear)
+{
+    const struct nk_command *cmd;
+    struct nk_context *ctx = &xlib.ctx;
+
+    /* the last frame may still be on its way out of fb */
+    if (surf->presented) {
+        XSync(surf->dpy, False);
+        surf->presented = 0;
+    }
+
+    nk_xshm_clear(surf, (nk_uint)nk_color_from_byte(&clear.r));
+    nk_foreach(cmd, &xlib.ctx)
+    {
+        switch (cmd->type) {
+        case NK_COMMAND_NOP: break;
+        case NK_COMMAND_SCISSOR: {
+            const struct nk_command_scissor *s =(const struct nk_command_scissor*)cmd;
+            nk_xshm_scissor(surf, s->x, s->y, s->w, s->h);
+        } break;
+        case NK_COMMAND_LINE: {
+            const struct nk_command_line *l = (const struct nk_command_line *)cmd;
+            nk_xshm_stroke_line(surf, l->begin.x, l->begin.y, l->end.x,
+                l->end.y, l->line_thickness, l->color);
+        } break;
+        case NK_COMMAND_RECT: {
+            const struct nk_command_rect *r = (const struct nk_command_rect *)cmd;
+            nk_xshm_stroke_rect(surf, r->x, r->y, NK_MAX(r->w -r->line_thickness, 0),
+                NK_MAX(r->h - r->line_thickness, 0), (unsigned short)r->rounding,
+                r->line_thickness, r->color);
+        } break;
+        case NK_COMMAND_RECT_FILLED: {
+            const struct nk_command_rect_filled *r = (const struct nk_command_rect_filled *)cmd;
+            nk_xshm_fill_rect(surf, r->x, r->y, r->w, r->h,
+                (unsigned short)r->rounding, r->color);
+        } break;
+        case NK_COMMAND_CIRCLE: {
+            const struct nk_command_circle *c = (const struct nk_command_circle *)cmd;
+            nk_xshm_stroke_circle(surf, c->x, c->y, c->w, c->h, c->line_thickness, c->color);
+        } break;
+        case NK_COMMAND_CIRCLE_FILLED: {
+            const struct nk_command_circle_filled *c = (const struct nk_command_circle_filled *)cmd;
+            nk_xshm_fill_circle(surf, c->x, c->y, c->w, c->h, c->color);
+        } break;
+        case NK_COMMAND_TRIANGLE: {
+            const struct nk_command_triangle*t = (const struct nk_command_triangle*)cmd;
+            nk_xshm_stroke_triangle(surf, t->a.x, t->a.y, t->b.x, t->b.y,
+                t->c.x, t->c.y, t->line_thickness, t->color);
+        } break;
+        case NK_COMMAND_TRIANGLE_FILLED: {
+            const struct nk_command_triangle_filled *t = (const struct nk_command_triangle_filled *)cmd;
+            nk_xshm_fill_triangle(surf, t->a.x, t->a.y, t->b.x, t->b.y,
+                t->c.x, t->c.y, t->color);
+        } break;
+        case NK_COMMAND_POLYGON: {
+            const struct nk_command_polygon *p =(const struct nk_command_polygon*)cmd;
+            nk_xshm_stroke_polygon(surf, p->points, p->point_count, p->line_thickness,p->color);
+        } break;
+        case NK_COMMAND_POLYGON_FILLED: {
+            const struct nk_command_polygon_filled *p = (const struct nk_command_polygon_filled *)cmd;
+            nk_xshm_fill_polygon(surf, p->points, p->point_count, p->color);
+        } break;
+        case NK_COMMAND_POLYLINE: {
+            const struct nk_command_polyline *p = (const struct nk_command_polyline *)cmd;
+            nk_xshm_stroke_polyline(surf, p->points, p->point_count, p->line_thickness, p->color);
+        } break;
+        case NK_COMMAND_TEXT: {
+            const struct nk_command_text *t = (const struct nk_command_text*)cmd;
+            nk_xshm_draw_text(surf, t->x, t->y, t->w, t->h,
+                (const char*)t->string, t->length,
+                (XFont*)t->font->userdata.ptr,
+                t->background, t->foreground);
+        } break;
+        case NK_COMMAND_CURVE: {
+            const struct nk_command_curve *q = (const struct nk_command_curve *)cmd;
+            nk_xshm_stroke_curve(surf, q->begin, q->ctrl[0], q->ctrl[1],
+                q->end, 22, q->line_thickness, q->color);
+        } break;
+        case NK_COMMAND_IMAGE: {
+            const struct nk_command_image *i = (const struct nk_command_image *)cmd;
+            nk_xshm_draw_image(surf, i->x, i->y, i->w, i->h, i->img, i->col);
+        } break;
+        case NK_COMMAND_RECT_MULTI_COLOR:
+        case NK_COMMAND_ARC:
+        case NK_COMMAND_ARC_FILLED:
+        case NK_COMMAND_CUSTOM:
+        default: break;
+        }
+    }
+    nk_clear(ctx);
+    XShmPutImage(surf->dpy, screen, surf->gc, surf->fb, 0, 0, 0, 0, surf->w, surf->h, False);
+    surf->presented = 1;
+}
+#undef NK_XSHM_ROW
+#endif /* NK_XLIB_USE_XSHM */
+
 NK_API void
 nk_xlib_shutdown(void)
 {
@@ -878,6 +1531,9 @@ nk_xlib_render(Drawable screen, struct nk_color clear)
     struct nk_context *ctx = &xlib.ctx;
     XSurface *surf = xlib.surf;
 
+#ifdef NK_XLIB_USE_XSHM
+    if (surf->fb) {nk_xshm_render(screen, surf, clear); return;}
+#endif
     nk_xsurf_clear(xlib.surf, nk_color_from_byte(&clear.r));
     nk_foreach(cmd, &xlib.ctx)
     {
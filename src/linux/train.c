@@ -0,0 +1,231 @@
+#define _GNU_SOURCE // For sched_setaffinity
+
+// Headless trainer, same platform layer as the app but no X11 or sound.
+// Progress goes to stdout, the last line is a JSON summary.
+//
+// With `--scaling=N' it trains once for every thread count from 1 to N
+// on the same data instead, and the last line compares their throughput.
+//
+// With `--compare-async' it trains with seeded synchronous SGD, then with
+// Hogwild from the same initial parameters, and the last line compares
+// how far each converged on the same evaluation samples.
+
+#include "../types.h"
+#include "../platform.h"
+#include "../training.h"
+
+#include "linux_platform.h"
+
+typedef struct
+{
+  u32       thread_count;
+  double    samples_per_second;
+  double    epoch_seconds;
+} ScalingPoint;
+
+// Removes `--scaling=N' from the arguments into `max_threads', 0 without
+// it. N is at most the online CPU count, it sizes a stack array.
+static bool
+take_scaling_arg (int *argc, char **argv, u32 *max_threads)
+{
+  bool success = true;
+  *max_threads = 0;
+  int j = 1;
+  for (int i = 1; i < *argc; ++i)
+    {
+      if (strncmp (argv[i], "--scaling=", 10) != 0)
+        {
+          argv[j++] = argv[i];
+          continue;
+        }
+
+      const char *value = argv[i] + 10;
+      long ncpus = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1L);
+      if (!parse_config_u32 (value, max_threads)
+          || *max_threads == 0 || (long) *max_threads > ncpus)
+        {
+          fprintf (stderr, "--scaling: expected 1 to %ld threads, got `%s'\n",
+                   ncpus, value);
+          *max_threads = 0;
+          success = false;
+        }
+    }
+  *argc = j;
+  return success;
+}
+
+// Removes `--compare-async' from the arguments, true if it was there
+static bool
+take_compare_async_arg (int *argc, char **argv)
+{
+  bool found = false;
+  int j = 1;
+  for (int i = 1; i < *argc; ++i)
+    {
+      if (strcmp (argv[i], "--compare-async") == 0)
+        found = true;
+      else
+        argv[j++] = argv[i];
+    }
+  *argc = j;
+  return found;
+}
+
+static void
+print_scaling_summary (FILE *out, ScalingPoint *points, u32 npoints)
+{
+  fprintf (out, "{\"scaling\": [");
+  for (u32 i = 0; i < npoints; ++i)
+    {
+      ScalingPoint *point = &points[i];
+      double speedup = point->samples_per_second / points[0].samples_per_second;
+      fprintf (out, "%s{\"threads\": %u, \"samples_per_second\": %.1f, "
+               "\"epoch_seconds\": %.6f, \"speedup\": %.3f, "
+               "\"efficiency\": %.3f}",
+               (i > 0) ? ", " : "", point->thread_count,
+               point->samples_per_second, point->epoch_seconds, speedup,
+               speedup / point->thread_count);
+    }
+  fprintf (out, "]}\n");
+  fflush (out);
+}
+
+static void
+print_compare_async_summary (FILE *out, TrainingStats *stats)
+{
+  static const char *optimizers[2] = {"sgd", "hogwild"};
+  fprintf (out, "{\"compare_async\": [");
+  for (u32 i = 0; i < 2; ++i)
+    {
+      double seconds = (double) stats[i].training_ticks / TICKS_PER_SECOND;
+      fprintf (out, "%s{\"optimizer\": \"%s\", \"epochs\": %u, "
+               "\"samples_per_second\": %.1f, ", (i > 0) ? ", " : "",
+               optimizers[i], stats[i].epochs,
+               (seconds > 0.) ? stats[i].samples / seconds : 0.);
+      if (stats[i].evaluation_count > 0)
+        fprintf (out, "\"accuracy\": %.6f, \"cost\": %.6f}",
+                 (double) stats[i].correct_count / stats[i].evaluation_count,
+                 stats[i].cost);
+      else
+        fprintf (out, "\"accuracy\": null, \"cost\": null}");
+    }
+  fprintf (out, "]}\n");
+  fflush (out);
+}
+
+// Both runs start from the parameters of `seed', the evaluation samples
+// are held back from the end of `data' which shuffling leaves alone
+static void
+compare_async (AppConfig *config, float *data, u32 count, u64 seed)
+{
+  MemoryPool pool = {};
+  TrainingStats stats[2];
+  AppConfig sync_config = *config;
+  sync_config.async_sgd = false;
+  sync_config.seed = seed;
+  Network *network = create_configured_network (&sync_config);
+  float *parameters = push_array (&pool, float, network->parameters.nmemb,
+                                  MEMORY_FLAG_NONE);
+  memcpy (parameters, network->parameters.base,
+          sizeof (float) * network->parameters.nmemb);
+  stats[0] = run_training (network, &sync_config, data, count);
+  print_training_summary (stdout, &sync_config, &stats[0]);
+  destroy_network (network);
+
+  AppConfig async_config = *config;
+  async_config.async_sgd = true;
+  async_config.seed = 0;
+  network = create_configured_network (&async_config);
+  memcpy (network->parameters.base, parameters,
+          sizeof (float) * network->parameters.nmemb);
+  stats[1] = run_training (network, &async_config, data, count);
+  print_training_summary (stdout, &async_config, &stats[1]);
+  destroy_network (network);
+
+  clear_memory_pool (&pool);
+  print_compare_async_summary (stdout, stats);
+}
+
+int
+main (int argc, char **argv)
+{
+  linux_init_platform ();
+
+  u32 max_threads;
+  bool scaling_ok = take_scaling_arg (&argc, argv, &max_threads);
+  bool comparing_async = take_compare_async_arg (&argc, argv);
+  AppConfig config = default_app_config ();
+  bool config_ok = parse_config_args (&config, argc, argv) && scaling_ok;
+  if (config_ok && comparing_async)
+    {
+      // Hogwild has to be able to run with the rest of the options
+      AppConfig async_config = config;
+      async_config.async_sgd = true;
+      async_config.seed = 0;
+      config_ok = validate_app_config (&async_config);
+      if (max_threads > 0)
+        {
+          fprintf (stderr, "--compare-async and --scaling are exclusive\n");
+          config_ok = false;
+        }
+    }
+  if (!config_ok)
+    {
+      print_config_usage (stderr, argv[0]);
+      fprintf (stderr, "  or --scaling=N to compare 1 to N threads\n");
+      fprintf (stderr, "  or --compare-async to compare hogwild with sgd\n");
+      return EXIT_FAILURE;
+    }
+  if (config.counters && !enable_profile_counters ())
+    fprintf (stderr, "counters: perf_event_open is not available\n");
+
+  MemoryPool data_pool = {};
+  u32 count;
+  float *data = load_training_data (&data_pool, &config, &count);
+
+  if (comparing_async)
+    {
+      // @Hardcode seed when none is given
+      compare_async (&config, data, count, config.seed ? config.seed : 1);
+    }
+  else if (max_threads == 0)
+    {
+      Network *network = create_configured_network (&config);
+      TrainingStats stats = run_training (network, &config, data, count);
+      print_training_summary (stdout, &config, &stats);
+      destroy_network (network);
+      if (config.profile || config.counters)
+        print_profile (stderr);
+    }
+  else
+    {
+      ScalingPoint points[max_threads];
+      for (u32 t = 1; t <= max_threads; ++t)
+        {
+          config.thread_count = t;
+          if (t > 1)
+            reset_profile (); // Keeps the load in the first run
+          Network *network = create_configured_network (&config);
+          TrainingStats stats = run_training (network, &config, data, count);
+          print_training_summary (stdout, &config, &stats);
+          destroy_network (network);
+          if (config.profile || config.counters)
+            {
+              fprintf (stderr, "threads: %u\n", t);
+              print_profile (stderr);
+            }
+
+          double seconds = (double) stats.training_ticks / TICKS_PER_SECOND;
+          points[t - 1] = (ScalingPoint) {
+            .thread_count       = t,
+            .samples_per_second = stats.samples / seconds,
+            .epoch_seconds      = seconds / stats.epochs
+          };
+        }
+      print_scaling_summary (stdout, points, max_threads);
+    }
+
+  clear_memory_pool (&data_pool);
+
+  return EXIT_SUCCESS;
+}
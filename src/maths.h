@@ -16,29 +16,225 @@
 #define logf(x)     __builtin_logf (x)
 #define powf(x, y)  __builtin_powf (x, y)
 
-float
-generate_gaussian_noise (float median, float variance)
+// xoshiro128+ running four independent streams, one per SSE lane. Not
+// thread safe, every thread keeps its own.
+typedef struct
 {
-  static float z1;
-  static bool generate;
-  generate = !generate;
+  __m128i s[4];
+} Random;
 
-  if (!generate)
-    return (z1 * variance) + median;
+static inline u64
+splitmix64 (u64 *state)
+{
+  u64 z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline void
+seed_random (Random *random, u64 seed)
+{
+  u64 words[8];
+  for (u32 i = 0; i < 8; ++i)
+    words[i] = splitmix64 (&seed);
+  for (u32 i = 0; i < 4; ++i)
+    random->s[i] = _mm_set_epi64x ((long long) words[2 * i + 1],
+                                   (long long) words[2 * i]);
+}
+
+static inline __m128i
+random_u32x4 (Random *random)
+{
+  __m128i *s = random->s;
+  __m128i result = _mm_add_epi32 (s[0], s[3]);
+  __m128i t = _mm_slli_epi32 (s[1], 9);
+  s[2] = _mm_xor_si128 (s[2], s[0]);
+  s[3] = _mm_xor_si128 (s[3], s[1]);
+  s[1] = _mm_xor_si128 (s[1], s[2]);
+  s[0] = _mm_xor_si128 (s[0], s[3]);
+  s[2] = _mm_xor_si128 (s[2], t);
+  s[3] = _mm_or_si128 (_mm_slli_epi32 (s[3], 11), _mm_srli_epi32 (s[3], 21));
+  return result;
+}
+
+// Uniform in [0, 1), the top 24 bits of every lane
+static inline __m128
+random_unit_x4 (Random *random)
+{
+  __m128i bits = _mm_srli_epi32 (random_u32x4 (random), 8);
+  return _mm_mul_ps (_mm_cvtepi32_ps (bits), _mm_set1_ps (1.f / 16777216.f));
+}
 
-  float u1, u2;
-  do
+static inline u64
+random_u64 (Random *random)
+{
+  return (u64) _mm_cvtsi128_si64 (random_u32x4 (random));
+}
+
+static inline __m128i
+hash_u32x4 (__m128i x)
+{
+  x = _mm_xor_si128 (x, _mm_srli_epi32 (x, 16));
+  x = _mm_mullo_epi32 (x, _mm_set1_epi32 (0x7feb352d));
+  x = _mm_xor_si128 (x, _mm_srli_epi32 (x, 15));
+  x = _mm_mullo_epi32 (x, _mm_set1_epi32 ((int) 0x846ca68b));
+  return _mm_xor_si128 (x, _mm_srli_epi32 (x, 16));
+}
+
+// Counter based, uniform in [0, 1) for `index' to `index' + 3 of the
+// sequence named `key'. Unlike a Random stream, any part of the sequence
+// comes out the same no matter where one starts drawing it.
+static inline __m128
+random_unit_at_x4 (u64 key, u32 index)
+{
+  __m128i x = _mm_add_epi32 (_mm_set1_epi32 ((int) index),
+                             _mm_setr_epi32 (0, 1, 2, 3));
+  x = hash_u32x4 (_mm_xor_si128 (x, _mm_set1_epi32 ((int) key)));
+  x = hash_u32x4 (_mm_xor_si128 (x, _mm_set1_epi32 ((int) (key >> 32))));
+  __m128i bits = _mm_srli_epi32 (x, 8);
+  return _mm_mul_ps (_mm_cvtepi32_ps (bits), _mm_set1_ps (1.f / 16777216.f));
+}
+
+// Natural logarithm of positive, normal floats (Cephes logf)
+static inline __m128
+log_x4 (__m128 x)
+{
+  __m128i bits = _mm_castps_si128 (x);
+  __m128 e = _mm_cvtepi32_ps (_mm_sub_epi32 (_mm_srli_epi32 (bits, 23),
+                                             _mm_set1_epi32 (126)));
+  // Mantissa in [.5, 1)
+  __m128 mantissa_mask = _mm_castsi128_ps (_mm_set1_epi32 (0x807fffff));
+  __m128 m = _mm_or_ps (_mm_and_ps (x, mantissa_mask), _mm_set1_ps (.5f));
+  __m128 small = _mm_cmplt_ps (m, _mm_set1_ps (0.707106781186547524f));
+  e = _mm_sub_ps (e, _mm_and_ps (small, _mm_set1_ps (1.f)));
+  m = _mm_sub_ps (_mm_add_ps (m, _mm_and_ps (small, m)), _mm_set1_ps (1.f));
+
+  __m128 z = _mm_mul_ps (m, m);
+  __m128 y = _mm_set1_ps (7.0376836292e-2f);
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (-1.1514610310e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (1.1676998740e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (-1.2420140846e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (1.4249322787e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (-1.6668057665e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (2.0000714765e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (-2.4999993993e-1f));
+  y = _mm_add_ps (_mm_mul_ps (y, m), _mm_set1_ps (3.3333331174e-1f));
+  y = _mm_mul_ps (_mm_mul_ps (y, m), z);
+  y = _mm_add_ps (y, _mm_mul_ps (e, _mm_set1_ps (-2.12194440e-4f)));
+  y = _mm_sub_ps (y, _mm_mul_ps (z, _mm_set1_ps (.5f)));
+  y = _mm_add_ps (y, m);
+  return _mm_add_ps (y, _mm_mul_ps (e, _mm_set1_ps (.693359375f)));
+}
+
+// Box-Muller, eight standard normal samples per call. The angle is a
+// random quadrant plus an offset in [-pi/4, pi/4) where short
+// polynomials are accurate.
+static inline void
+random_gaussian_x8 (Random *random, __m128 *z0, __m128 *z1)
+{
+  __m128 scale = _mm_set1_ps (1.f / 16777216.f);
+  __m128i bits = random_u32x4 (random);
+  bits = _mm_add_epi32 (_mm_srli_epi32 (bits, 8), _mm_set1_epi32 (1));
+  __m128 u1 = _mm_mul_ps (_mm_cvtepi32_ps (bits), scale); // In (0, 1]
+  __m128 r = _mm_sqrt_ps (_mm_mul_ps (_mm_set1_ps (-2.f), log_x4 (u1)));
+
+  bits = random_u32x4 (random);
+  __m128 u2 = _mm_mul_ps (_mm_cvtepi32_ps (_mm_srli_epi32 (bits, 8)), scale);
+  __m128 t = _mm_mul_ps (_mm_sub_ps (u2, _mm_set1_ps (.5f)),
+                         _mm_set1_ps ((float) (M_PI / 2)));
+  __m128 t2 = _mm_mul_ps (t, t);
+
+  __m128 sin_t = _mm_set1_ps (-1.9515295891e-4f);
+  sin_t = _mm_add_ps (_mm_mul_ps (sin_t, t2), _mm_set1_ps (8.3321608736e-3f));
+  sin_t = _mm_add_ps (_mm_mul_ps (sin_t, t2), _mm_set1_ps (-1.6666654611e-1f));
+  sin_t = _mm_add_ps (_mm_mul_ps (_mm_mul_ps (sin_t, t2), t), t);
+
+  __m128 cos_t = _mm_set1_ps (2.4433157118e-5f);
+  cos_t = _mm_add_ps (_mm_mul_ps (cos_t, t2), _mm_set1_ps (-1.3887316255e-3f));
+  cos_t = _mm_add_ps (_mm_mul_ps (cos_t, t2), _mm_set1_ps (4.1666645683e-2f));
+  cos_t = _mm_mul_ps (_mm_mul_ps (cos_t, t2), t2);
+  cos_t = _mm_add_ps (_mm_sub_ps (cos_t, _mm_mul_ps (t2, _mm_set1_ps (.5f))),
+                      _mm_set1_ps (1.f));
+
+  // Rotate by the quadrant taken from bits the offset does not use,
+  // (c, s) -> (-s, c) for an odd quadrant and negated for the upper two
+  __m128i quadrant = _mm_srli_epi32 (bits, 6);
+  __m128i one = _mm_set1_epi32 (1);
+  __m128i two = _mm_set1_epi32 (2);
+  __m128 odd = _mm_castsi128_ps (
+    _mm_cmpeq_epi32 (_mm_and_si128 (quadrant, one), one));
+  __m128 sign = _mm_castsi128_ps (
+    _mm_slli_epi32 (_mm_and_si128 (quadrant, two), 30));
+  __m128 neg_sin_t = _mm_xor_ps (sin_t, _mm_set1_ps (-0.f));
+  __m128 c = _mm_blendv_ps (cos_t, neg_sin_t, odd);
+  __m128 s = _mm_blendv_ps (sin_t, cos_t, odd);
+  *z0 = _mm_mul_ps (r, _mm_xor_ps (c, sign));
+  *z1 = _mm_mul_ps (r, _mm_xor_ps (s, sign));
+}
+
+static inline void
+fill_gaussian_noise (Random *random, float *out, u32 nmemb, float median,
+                     float variance)
+{
+  __m128 mean = _mm_set1_ps (median);
+  __m128 scale = _mm_set1_ps (variance);
+  u32 i = 0;
+  for (; i + 8 <= nmemb; i += 8)
+    {
+      __m128 z0, z1;
+      random_gaussian_x8 (random, &z0, &z1);
+      _mm_storeu_ps (out + i, _mm_add_ps (_mm_mul_ps (z0, scale), mean));
+      _mm_storeu_ps (out + i + 4, _mm_add_ps (_mm_mul_ps (z1, scale), mean));
+    }
+  if (i < nmemb)
+    {
+      // Nothing is written past `nmemb'
+      float tail[8];
+      __m128 z0, z1;
+      random_gaussian_x8 (random, &z0, &z1);
+      _mm_storeu_ps (tail, _mm_add_ps (_mm_mul_ps (z0, scale), mean));
+      _mm_storeu_ps (tail + 4, _mm_add_ps (_mm_mul_ps (z1, scale), mean));
+      for (u32 j = 0; i < nmemb; ++i, ++j)
+        out[i] = tail[j];
+    }
+}
+
+static u64 g_random_seed = 0x853c49e6748fea9bull;
+static u32 g_random_thread_count;
+
+// This thread's generator, seeded from `g_random_seed' and the order in
+// which threads first ask for one
+static inline Random *
+thread_random (void)
+{
+  static __thread Random random;
+  static __thread bool seeded;
+  if (!seeded)
     {
-      u1 = rand () * (1.f / RAND_MAX);
-      u2 = rand () * (1.f / RAND_MAX);
+      u64 stream = __sync_fetch_and_add (&g_random_thread_count, 1);
+      seed_random (&random, g_random_seed ^ (stream << 32));
+      seeded = true;
     }
-  while (u1 <= FLT_MIN);
+  return &random;
+}
 
-  float z0;
-  z0 = sqrtf (-2.f * logf (u1)) * cosf (M_TAU * u2);
-  z1 = sqrtf (-2.f * logf (u1)) * sinf (M_TAU * u2);
+float
+generate_gaussian_noise (float median, float variance)
+{
+  static __thread float buffer[8];
+  static __thread u32 available;
+
+  if (available == 0)
+    {
+      __m128 z0, z1;
+      random_gaussian_x8 (thread_random (), &z0, &z1);
+      _mm_storeu_ps (buffer, z0);
+      _mm_storeu_ps (buffer + 4, z1);
+      available = 8;
+    }
 
-  return (z0 * variance) + median;
+  return (buffer[--available] * variance) + median;
 }
 
 #endif /* ! MATHS_H */
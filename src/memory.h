@@ -48,15 +48,16 @@ push_bytes_aligned (MemoryPool *pool, size_t nbytes, size_t alignment, flags_t f
       MemoryBlock *new_block = NULL;
       size_t block_size = 1024 * 1024; // @Hardcode
 
-      size = nbytes;
-
-      if (size > block_size)
-        block_size = size;
+      // The base of a block sized to fit is not necessarily aligned
+      if (nbytes + (alignment - 1) > block_size)
+        block_size = nbytes + (alignment - 1);
 
       new_block = g_platform->allocate_memory (block_size,
                                                MEMORY_BLOCK_FLAG_OVERFLOW_CHECK);
       new_block->prev = pool->current_block;
       pool->current_block = new_block;
+
+      size = nbytes + get_alignment_offset (pool, alignment);
     }
 
   assert ((pool->current_block->used + size) <= pool->current_block->size);
@@ -106,6 +107,18 @@ clear_memory_pool (MemoryPool *pool)
     }
 }
 
+static inline void
+get_memory_pool_usage (MemoryPool *pool, u64 *size, u64 *used)
+{
+  *size = 0;
+  *used = 0;
+  for (MemoryBlock *block = pool->current_block; block; block = block->prev)
+    {
+      *size += block->size;
+      *used += block->used;
+    }
+}
+
 static inline void *
 init_push_bytes (size_t nbytes, size_t alignment, size_t pool_offset, flags_t flags)
 {
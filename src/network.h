@@ -3,14 +3,88 @@
 
 #include "memory.h"
 #include "maths.h"
+#include "profile.h"
+#include "telemetry.h"
+
+#include <stdio.h>
+
+// Inputs with fewer non-zero elements than this fraction take the sparse path
+#define SPARSE_INPUT_DENSITY 0.5f
+// Output columns per tile in the transpose product (4KiB of floats)
+#define TRANSPOSE_TILE_WIDTH 1024
+// Multiply-adds a slice of a split layer should at least get
+#define LAYER_SLICE_MIN_WORK (16 * 1024)
+// Alignment of every layer's weights and biases in the parameter buffer,
+// and of every vector the kernels read or write
+#define PARAMETER_ALIGNMENT 64
+// Weight rows and vectors are padded with zeros to a multiple of this
+#define NETWORK_SIMD_WIDTH 8
+#define SIMD_PADDED(count) ALIGN_POW2 ((count), NETWORK_SIMD_WIDTH)
+
+// Larger layers are averaged down in the UI's copies
+#define WEIGHT_SNAPSHOT_MAX_WIDTH 512 // @Hardcode
+#define WEIGHT_SNAPSHOT_MAX_HEIGHT 512 // @Hardcode
+#define WEIGHT_SNAPSHOT_FRESH 0x4 // Beside a buffer index
 
 typedef struct _Network Network;
 
+typedef enum
+{
+  LEARNING_RATE_CONSTANT,
+  LEARNING_RATE_STEP,       // eta * decay every `step_epochs'
+  LEARNING_RATE_COSINE,     // eta down to `min_eta' over all epochs
+  LEARNING_RATE_PLATEAU     // eta * decay after `plateau_patience' bad epochs
+} LearningRateSchedule;
+
+#define SCHEDULE_MAX_BATCH_STEPS 8
+
+typedef struct
+{
+  u32 epoch; // From 0
+  u32 mini_batch_size; // From this epoch on
+} BatchStep;
+
+typedef struct
+{
+  LearningRateSchedule  kind;
+  u32                   step_epochs;
+  float                 decay;
+  float                 min_eta;
+  u32                   plateau_patience;
+  u32                   patience; // Epochs without a better cost before
+                                  // stopping, 0 never stops early
+  BatchStep             batch_steps[SCHEDULE_MAX_BATCH_STEPS]; // By epoch
+  u32                   nbatch_steps;
+} TrainingSchedule;
+
+// Random transforms applied to training images as they are copied into
+// the network's input buffer
+typedef struct
+{
+  u32   image_width;
+  u32   image_height;
+  u32   max_shift; // In pixels, along both axes
+  float max_rotation; // In radians, either way
+  float noise; // Uniform noise amplitude, pixels are kept in [0, 1]
+} Augmentation;
+
+typedef struct
+{
+  u32   epochs; // Fewer than asked for when stopped early
+  u64   samples; // Trained on across all processes
+  u64   training_ticks; // Excluding evaluation
+  u32   correct_count; // Of the parameters returned
+  u32   evaluation_count; // Nothing was evaluated if 0
+  float cost; // Of the parameters returned
+  float best_cost;
+} TrainingStats;
+
 typedef struct
 {
   u32 height;
   float *zs;
   float *activation;
+  float *mask; // Dropout scale of every activation, 0 for dropped units
 } ForwardResultLayer;
 
 typedef struct
@@ -20,14 +94,24 @@ typedef struct
     ForwardResultLayer *base;
     u32                 nmemb;
   } layers;
+  float                *input; // Zero-padded copy of the input
+  struct
+  {
+    u32                *base;
+    u32                 nmemb;
+  } input_indices; // Non-zero input columns, valid if `sparse_input' is set
+  bool                  sparse_input;
+  bool                  training; // Apply dropout and augmentation
+  u64                   seed; // Of this sample's dropout and augmentation
 } ForwardResult;
 
 typedef struct
 {
   u32 width;
   u32 height;
+  u32 stride;
   float *delta_b;
-  float *delta_w;
+  float *delta_w; // Only allocated for the mini-batch sum
 } BackwardResultLayer;
 
 typedef struct
@@ -37,6 +121,7 @@ typedef struct
     BackwardResultLayer    *base;
     u32                     nmemb;
   } layers;
+  float                    *gradient; // Laid out like `Network.parameters'
 } BackwardResult;
 
 typedef struct
@@ -52,10 +137,99 @@ typedef struct
 {
   u32 width;
   u32 height;
+  u32 stride; // Floats per weight row, `width' padded to NETWORK_SIMD_WIDTH
+  u32 biases_offset; // Into the parameter buffer
+  u32 weights_offset;
   float *biases;
   float *weights;
 } NetworkLayer;
 
+typedef struct
+{
+  u32 width; // Of the copy, at most WEIGHT_SNAPSHOT_MAX_WIDTH
+  u32 height;
+  float *weights; // Rows of `width'
+  float *biases;
+} WeightSnapshotLayer;
+
+typedef struct
+{
+  WeightSnapshotLayer  *layers;
+  u32                   nlayers;
+  u32                   step_count; // Mini-batches trained when copied
+} WeightSnapshot;
+
+// Triple buffered so neither side waits. The trainer fills `back' and
+// swaps it with `middle', the UI swaps `front' with `middle' whenever
+// the trainer has refilled that.
+typedef struct
+{
+  WeightSnapshot    buffers[3];
+  volatile u32      middle; // WEIGHT_SNAPSHOT_FRESH until the UI takes it
+  u32               back; // Trainer only
+  u32               front; // UI only
+} WeightSnapshots;
+
+typedef struct
+{
+  float        *training_data;
+  u32           training_data_count;
+  volatile u32  next_sample;
+  u32           max_mini_batch_size; // That there are results for
+  float         eta;
+  float         lmbda;
+  volatile u32  publishing; // A worker is copying a weight snapshot
+} AsyncEpoch;
+
+// The forward pass of every layer and then the backward passes in
+// reverse, a chain of 2 * nlayers stages
+typedef struct
+{
+  Network  *network;
+  u32       nlayers;
+  u32       nmicro;
+  u32       micro_batch_size;
+  u32       mini_batch_size;
+  u32      *next; // Micro-batch each stage hands out next
+  u32      *done; // Set per stage and micro-batch, nmicro per stage
+} Pipeline;
+
+typedef struct
+{
+  Pipeline *pipeline;
+  u32       stage;
+} PipelineWorker;
+
+typedef enum
+{
+  LAYER_SLICE_FORWARD,
+  LAYER_SLICE_BACKWARD,
+  LAYER_SLICE_ACCUMULATE
+} LayerSliceKind;
+
+typedef struct
+{
+  Network          *network;
+  LayerSliceKind    kind;
+  u32               layer;
+  u32               begin; // Output rows of this slice
+  u32               end;
+  float            *input;
+  float            *y;
+  ForwardResult    *forward;
+  BackwardResult   *backward;
+  u32               mini_batch_size;
+} LayerSlice;
+
+typedef struct
+{
+  Network          *network;
+  AsyncEpoch       *epoch;
+  MiniBatchResult  *results; // One per sample in a mini-batch
+  BackwardResult   *gradient;
+  Random            random; // Per-sample seeds of this worker
+} AsyncWorker;
+
 struct _Network
 {
   MemoryPool        mpool;
@@ -65,13 +239,39 @@ struct _Network
     u32             nmemb;
   } layers;
   struct
+  {
+    float          *base;
+    u32             nmemb;
+    u32             nweights; // All weights come first, then all biases
+  } parameters;
+  struct
   {
     MiniBatchResult    *base;
     u32                 nmemb;
-  } mini_batch_results;
+  } mini_batch_results; // Grown on demand, may exceed `mini_batch_size'
+  u32               mini_batch_size;
   ForwardResult    *validation_forward_result;
   BackwardResult   *mini_batch_backward_result;
   WorkQueue        *work_queue;
+  Collective       *collective;
+  u32               collective_interval; // Mini-batches between syncs
+  u32               step_count;
+  struct
+  {
+    AsyncWorker    *base;
+    u32             nmemb;
+  } async_workers; // Empty unless `network_enable_async' was called
+  u32               pipeline_micro_batch_size; // 0 unless pipelined
+  bool              split_layers;
+  TrainingSchedule  schedule;
+  float            *best_parameters; // Only kept when stopping early
+  float             dropout_keep; // Probability of keeping a hidden unit
+  Augmentation      augmentation; // Disabled while `image_width' is 0
+  Random            random; // Per-sample seeds for the mini-batches
+  bool              deterministic;
+  u32               thread_count; // Worker threads besides the caller
+  Telemetry        *telemetry; // Published to while training if set
+  WeightSnapshots  *weight_snapshots; // Published to while training if set
 };
 
 ForwardResult *
@@ -87,37 +287,118 @@ create_forward_result (Network *network)
       ForwardResultLayer *layer;
       layer = &result->layers.base[i];
       layer->height = network->layers.base[i].height;
-      layer->zs = push_array (&network->mpool, float, layer->height,
-                              MEMORY_FLAG_NONE);
-      layer->activation = push_array (&network->mpool, float, layer->height,
-                                      MEMORY_FLAG_NONE);
+      // The padding must stay zero, the kernels only write `height' floats
+      layer->zs = push_array_aligned (&network->mpool, float,
+                                      SIMD_PADDED (layer->height),
+                                      PARAMETER_ALIGNMENT, MEMORY_FLAG_ZERO);
+      layer->activation = push_array_aligned (&network->mpool, float,
+                                              SIMD_PADDED (layer->height),
+                                              PARAMETER_ALIGNMENT,
+                                              MEMORY_FLAG_ZERO);
+      layer->mask = push_array_aligned (&network->mpool, float,
+                                        SIMD_PADDED (layer->height),
+                                        PARAMETER_ALIGNMENT, MEMORY_FLAG_ZERO);
     }
+  result->input = push_array_aligned (&network->mpool, float,
+                                      network->layers.base[0].stride,
+                                      PARAMETER_ALIGNMENT, MEMORY_FLAG_ZERO);
+  result->input_indices.base = push_array (&network->mpool, u32,
+                                           network->layers.base[0].width,
+                                           MEMORY_FLAG_NONE);
+  result->input_indices.nmemb = 0;
+  result->sparse_input = false;
+  result->training = false;
+  result->seed = 0;
   return result;
 }
 
 BackwardResult *
-create_backward_result (Network *network)
+create_backward_result (Network *network, bool with_weights)
 {
   BackwardResult *result = push_struct (&network->mpool, BackwardResult,
                                         MEMORY_FLAG_NONE);
   result->layers.nmemb = network->layers.nmemb;
   result->layers.base = push_array (&network->mpool, BackwardResultLayer,
                                     result->layers.nmemb, MEMORY_FLAG_NONE);
+  result->gradient = NULL;
+  if (with_weights)
+    result->gradient = push_array_aligned (&network->mpool, float,
+                                           network->parameters.nmemb,
+                                           PARAMETER_ALIGNMENT,
+                                           MEMORY_FLAG_ZERO);
   for (u32 i = 0; i < result->layers.nmemb; ++i)
     {
       BackwardResultLayer *layer;
       layer = &result->layers.base[i];
       layer->width = network->layers.base[i].width;
       layer->height = network->layers.base[i].height;
-      layer->delta_w = push_array (&network->mpool, float,
-                                   layer->width * layer->height,
-                                   MEMORY_FLAG_NONE);
-      layer->delta_b = push_array (&network->mpool, float, layer->height,
-                                   MEMORY_FLAG_NONE);
+      layer->stride = network->layers.base[i].stride;
+      layer->delta_w = NULL;
+      if (with_weights)
+        {
+          layer->delta_w = result->gradient + network->layers.base[i].weights_offset;
+          layer->delta_b = result->gradient + network->layers.base[i].biases_offset;
+        }
+      else
+        {
+          layer->delta_b = push_array_aligned (&network->mpool, float,
+                                               SIMD_PADDED (layer->height),
+                                               PARAMETER_ALIGNMENT,
+                                               MEMORY_FLAG_ZERO);
+        }
     }
   return result;
 }
 
+#define NETWORK_DEFAULT_THREAD_COUNT 3u // @Hardcode
+
+static WorkQueue *
+create_network_work_queue (Network *network)
+{
+  // Room for a full mini-batch, one job per async worker or one job per
+  // pipeline stage, of which there are two per layer
+  u32 entry_count = MAX (network->mini_batch_results.nmemb,
+                         network->thread_count + 1);
+  entry_count = MAX (entry_count, 2 * network->layers.nmemb) * 2;
+  return create_work_queue (entry_count, network->thread_count);
+}
+
+MiniBatchResult *
+grow_mini_batch_results (Network *network, MiniBatchResult *old_results,
+                         u32 old_count, u32 count)
+{
+  // Pool memory is not freed, the old per-sample buffers are kept and
+  // only the missing ones are created
+  MiniBatchResult *results = push_array (&network->mpool, MiniBatchResult,
+                                         count, MEMORY_FLAG_NONE);
+  if (old_count > 0)
+    memcpy (results, old_results, sizeof (MiniBatchResult) * old_count);
+  for (u32 i = old_count; i < count; ++i)
+    {
+      MiniBatchResult *result = &results[i];
+      result->network = network;
+      result->forward = create_forward_result (network);
+      result->backward = create_backward_result (network, false);
+    }
+  return results;
+}
+
+static void
+randomize_network_parameters (Network *network)
+{
+  for (u32 i = 0; i < network->layers.nmemb; ++i)
+    {
+      NetworkLayer *layer = &network->layers.base[i];
+      fill_gaussian_noise (&network->random, layer->biases, layer->height,
+                           0, 1);
+      float deviation = 1.f / sqrtf ((float) layer->width);
+      for (u32 y = 0; y < layer->height; ++y)
+        fill_gaussian_noise (&network->random,
+                             layer->weights + (y * layer->stride),
+                             layer->width, 0, deviation);
+    }
+}
+
 Network *
 create_network (u32 *sizes, u32 nlayers, u32 mini_batch_size)
 {
@@ -128,48 +409,357 @@ create_network (u32 *sizes, u32 nlayers, u32 mini_batch_size)
   assert (mini_batch_size > 0);
 
   network = init_push_struct (Network, mpool, MEMORY_FLAG_ZERO);
+  network->dropout_keep = 1.f;
+  network->thread_count = NETWORK_DEFAULT_THREAD_COUNT;
+  seed_random (&network->random, random_u64 (thread_random ()));
 
   network->layers.nmemb = nlayers - 1;
   network->layers.base = push_array (&network->mpool, NetworkLayer, nlayers - 1,
                                      MEMORY_FLAG_NONE);
+
+  // Pack all parameters in one buffer, weights first, with every layer's
+  // part starting on its own PARAMETER_ALIGNMENT boundary. The padding
+  // is zero and stays zero through every update.
+  u32 align = PARAMETER_ALIGNMENT / sizeof (float);
+  u32 offset = 0;
   for (u32 i = 0; i < network->layers.nmemb; ++i)
     {
       NetworkLayer *layer = &network->layers.base[i];
       layer->width = sizes[i];
       layer->height = sizes[i + 1];
-      layer->weights = push_array (&network->mpool, float,
-                                   layer->width * layer->height,
-                                   MEMORY_FLAG_ZERO);
-      layer->biases = push_array (&network->mpool, float, layer->height,
-                                  MEMORY_FLAG_ZERO);
-      for (u32 y = 0; y < layer->height; ++y)
+      layer->stride = SIMD_PADDED (layer->width);
+      layer->weights_offset = offset;
+      offset += ALIGN_POW2 (layer->stride * layer->height, align);
+    }
+  network->parameters.nweights = offset;
+  for (u32 i = 0; i < network->layers.nmemb; ++i)
+    {
+      NetworkLayer *layer = &network->layers.base[i];
+      layer->biases_offset = offset;
+      offset += ALIGN_POW2 (layer->height, align);
+    }
+  network->parameters.nmemb = offset;
+  network->parameters.base = push_array_aligned (&network->mpool, float,
+                                                 network->parameters.nmemb,
+                                                 PARAMETER_ALIGNMENT,
+                                                 MEMORY_FLAG_ZERO);
+
+  for (u32 i = 0; i < network->layers.nmemb; ++i)
+    {
+      NetworkLayer *layer = &network->layers.base[i];
+      layer->weights = network->parameters.base + layer->weights_offset;
+      layer->biases = network->parameters.base + layer->biases_offset;
+    }
+  randomize_network_parameters (network);
+
+  network->mini_batch_size = mini_batch_size;
+  network->mini_batch_results.nmemb = mini_batch_size;
+  network->mini_batch_results.base = grow_mini_batch_results (network, NULL, 0,
+                                                              mini_batch_size);
+
+  network->validation_forward_result = create_forward_result (network);
+
+  network->mini_batch_backward_result = create_backward_result (network, true);
+
+  network->work_queue = create_network_work_queue (network);
+
+  return network;
+}
+
+// Train as one of several processes in `collective'. With an interval of
+// 1 the mini-batch gradients are summed across all processes, otherwise
+// the processes run local SGD and average their parameters every
+// `interval' mini-batches.
+void
+network_attach_collective (Network *network, Collective *collective,
+                           u32 interval)
+{
+  assert (interval > 0);
+  network->collective = collective;
+  network->collective_interval = interval;
+  network->step_count = 0;
+  // Forked trainers start out with the same generator state
+  seed_random (&network->random, (random_u64 (&network->random)
+                                  ^ collective_rank (collective)));
+  // A forked trainer does not inherit the worker threads, and those of
+  // the first process predate its NUMA binding, so both start new ones
+  if (collective_rank (collective) == 0)
+    destroy_work_queue (network->work_queue);
+  network->work_queue = create_network_work_queue (network);
+}
+
+// Must be called before async SGD is enabled
+void
+network_set_thread_count (Network *network, u32 thread_count)
+{
+  assert (network->async_workers.nmemb == 0);
+  network->thread_count = thread_count;
+  destroy_work_queue (network->work_queue);
+  network->work_queue = create_network_work_queue (network);
+}
+
+// Train Hogwild style: every worker pulls its own mini-batches and
+// writes its updates straight into the shared weights without any
+// synchronization between mini-batches
+void
+network_enable_async (Network *network)
+{
+  assert (network->collective == NULL);
+  assert (!network->deterministic);
+
+  // complete_all_work runs jobs on the calling thread as well
+  network->async_workers.nmemb = network->thread_count + 1;
+  network->async_workers.base = push_array (&network->mpool, AsyncWorker,
+                                            network->async_workers.nmemb,
+                                            MEMORY_FLAG_ZERO);
+  for (u32 i = 0; i < network->async_workers.nmemb; ++i)
+    {
+      AsyncWorker *worker = &network->async_workers.base[i];
+      worker->network = network;
+      worker->results
+        = grow_mini_batch_results (network, NULL, 0,
+                                   network->mini_batch_results.nmemb);
+      worker->gradient = create_backward_result (network, true);
+      seed_random (&worker->random, random_u64 (&network->random));
+    }
+}
+
+// Reinitialize the parameters from `seed' and draw every shuffle,
+// dropout mask and augmentation from it. The sums of a mini-batch are
+// already taken in sample order and the work split only depends on the
+// thread count, so runs with the same seed and thread count are bit
+// identical. Hogwild updates can not be, so async SGD is refused.
+// Call before training.
+void
+network_enable_deterministic (Network *network, u64 seed)
+{
+  assert (network->async_workers.nmemb == 0);
+  network->deterministic = true;
+  seed_random (&network->random, seed);
+  randomize_network_parameters (network);
+}
+
+// Drop every hidden unit of a training sample with probability `rate'
+// and scale the kept ones by 1 / (1 - rate). Evaluation is unaffected.
+void
+network_enable_dropout (Network *network, float rate)
+{
+  assert (rate >= 0.f && rate < 1.f);
+  network->dropout_keep = 1.f - rate;
+}
+
+void
+network_enable_augmentation (Network *network, Augmentation augmentation)
+{
+  assert (augmentation.image_width * augmentation.image_height
+          == network->layers.base[0].width);
+  network->augmentation = augmentation;
+}
+
+void
+network_set_schedule (Network *network, TrainingSchedule schedule)
+{
+  assert (schedule.kind != LEARNING_RATE_STEP || schedule.step_epochs > 0);
+  network->schedule = schedule;
+  if (schedule.patience > 0 && !network->best_parameters)
+    network->best_parameters = push_array_aligned (&network->mpool, float,
+                                                   network->parameters.nmemb,
+                                                   PARAMETER_ALIGNMENT,
+                                                   MEMORY_FLAG_NONE);
+}
+
+// `network_sgd' publishes its progress to `telemetry', which must outlive
+// the training
+void
+network_enable_telemetry (Network *network, Telemetry *telemetry)
+{
+  network->telemetry = telemetry;
+}
+
+// Box filter down to at most WEIGHT_SNAPSHOT_MAX_WIDTH by _HEIGHT
+static void
+copy_weight_snapshot (Network *network, WeightSnapshot *snapshot)
+{
+  snapshot->step_count = network->step_count;
+  for (u32 l = 0; l < snapshot->nlayers; ++l)
+    {
+      NetworkLayer *layer = &network->layers.base[l];
+      WeightSnapshotLayer *out = &snapshot->layers[l];
+      for (u32 y = 0; y < out->height; ++y)
         {
-          layer->biases[y] = generate_gaussian_noise (0, 1);
-          for (u32 x = 0, offset = y * layer->width; x < layer->width; ++x)
-            layer->weights[offset + x] = (generate_gaussian_noise (0, 1)
-                                          / sqrtf ((float) layer->width));
+          u32 y0 = (u32) (((u64) y * layer->height) / out->height);
+          u32 y1 = (u32) (((u64) (y + 1) * layer->height) / out->height);
+          float bias = 0.f;
+          for (u32 sy = y0; sy < y1; ++sy)
+            bias += layer->biases[sy];
+          out->biases[y] = bias / (y1 - y0);
+
+          float *row = out->weights + ((u64) y * out->width);
+          if (y1 - y0 == 1 && out->width == layer->width)
+            {
+              memcpy (row, layer->weights + ((u64) y0 * layer->stride),
+                      sizeof (float) * out->width);
+              continue;
+            }
+          for (u32 x = 0; x < out->width; ++x)
+            {
+              u32 x0 = (u32) (((u64) x * layer->width) / out->width);
+              u32 x1 = (u32) (((u64) (x + 1) * layer->width) / out->width);
+              float sum = 0.f;
+              for (u32 sy = y0; sy < y1; ++sy)
+                {
+                  const float *weights = (layer->weights
+                                          + ((u64) sy * layer->stride));
+                  for (u32 sx = x0; sx < x1; ++sx)
+                    sum += weights[sx];
+                }
+              row[x] = sum / ((y1 - y0) * (x1 - x0));
+            }
         }
     }
+}
+
+// Trainer side, must not run while the parameters are being updated
+// except by Hogwild workers
+static void
+publish_weight_snapshot (Network *network)
+{
+  WeightSnapshots *snapshots = network->weight_snapshots;
+  copy_weight_snapshot (network, &snapshots->buffers[snapshots->back]);
+  u32 middle = __atomic_exchange_n (&snapshots->middle,
+                                    snapshots->back | WEIGHT_SNAPSHOT_FRESH,
+                                    __ATOMIC_ACQ_REL);
+  snapshots->back = middle & ~WEIGHT_SNAPSHOT_FRESH;
+}
+
+// Whether the UI took the last one, there is no point copying before
+static inline bool
+weight_snapshot_taken (WeightSnapshots *snapshots)
+{
+  return !(__atomic_load_n (&snapshots->middle, __ATOMIC_RELAXED)
+           & WEIGHT_SNAPSHOT_FRESH);
+}
+
+// `network_sgd' publishes copies of the parameters for
+// `acquire_weight_snapshot', at most one per snapshot taken
+void
+network_enable_weight_snapshots (Network *network)
+{
+  if (network->weight_snapshots)
+    return;
+
+  WeightSnapshots *snapshots = push_struct (&network->mpool, WeightSnapshots,
+                                            MEMORY_FLAG_ZERO);
+  u32 nlayers = network->layers.nmemb;
+  for (u32 i = 0; i < ARRAY_COUNT (snapshots->buffers); ++i)
+    {
+      WeightSnapshot *snapshot = &snapshots->buffers[i];
+      snapshot->nlayers = nlayers;
+      snapshot->layers = push_array (&network->mpool, WeightSnapshotLayer,
+                                     nlayers, MEMORY_FLAG_ZERO);
+      for (u32 l = 0; l < nlayers; ++l)
+        {
+          NetworkLayer *layer = &network->layers.base[l];
+          WeightSnapshotLayer *out = &snapshot->layers[l];
+          out->width = MIN (layer->width, (u32) WEIGHT_SNAPSHOT_MAX_WIDTH);
+          out->height = MIN (layer->height, (u32) WEIGHT_SNAPSHOT_MAX_HEIGHT);
+          out->weights = push_array (&network->mpool, float,
+                                     (u64) out->width * out->height,
+                                     MEMORY_FLAG_ZERO);
+          out->biases = push_array (&network->mpool, float, out->height,
+                                    MEMORY_FLAG_ZERO);
+        }
+    }
+  snapshots->front = 0;
+  snapshots->middle = 1;
+  snapshots->back = 2;
+  network->weight_snapshots = snapshots;
+
+  publish_weight_snapshot (network);
+}
+
+// UI side, the snapshot stays valid and unchanged until the next call
+WeightSnapshot *
+acquire_weight_snapshot (Network *network)
+{
+  WeightSnapshots *snapshots = network->weight_snapshots;
+  assert (snapshots);
+  if (!weight_snapshot_taken (snapshots))
+    {
+      u32 middle = __atomic_exchange_n (&snapshots->middle, snapshots->front,
+                                        __ATOMIC_ACQ_REL);
+      snapshots->front = middle & ~WEIGHT_SNAPSHOT_FRESH;
+    }
+  return &snapshots->buffers[snapshots->front];
+}
+
+// Takes effect from the next mini-batch, even while training, and buffers
+// for a larger batch than any before are allocated then. Such a batch also
+// replaces the worker threads, the work queue must hold a job per sample.
+// Hogwild workers can't grow their buffers while they run, so they go no
+// larger than before until the next epoch. Trainer processes must all
+// make the same change before training starts.
+void
+network_set_mini_batch_size (Network *network, u32 mini_batch_size)
+{
+  assert (mini_batch_size > 0);
+  __atomic_store_n (&network->mini_batch_size, mini_batch_size,
+                    __ATOMIC_RELAXED);
+}
+
+// Must only be called while the work queue is idle
+static void
+reserve_mini_batch_results (Network *network, u32 mini_batch_size)
+{
+  u32 old_count = network->mini_batch_results.nmemb;
+  if (mini_batch_size <= old_count)
+    return;
 
-  network->mini_batch_results.nmemb = mini_batch_size;
   network->mini_batch_results.base
-    = push_array (&network->mpool, MiniBatchResult,
-                  network->mini_batch_results.nmemb, MEMORY_FLAG_NONE);
-  for (u32 i = 0; i < network->mini_batch_results.nmemb; ++i)
+    = grow_mini_batch_results (network, network->mini_batch_results.base,
+                               old_count, mini_batch_size);
+  network->mini_batch_results.nmemb = mini_batch_size;
+
+  for (u32 i = 0; i < network->async_workers.nmemb; ++i)
     {
-      MiniBatchResult *result = &network->mini_batch_results.base[i];
-      result->network = network;
-      result->forward = create_forward_result (network);
-      result->backward = create_backward_result (network);
+      AsyncWorker *worker = &network->async_workers.base[i];
+      worker->results = grow_mini_batch_results (network, worker->results,
+                                                 old_count, mini_batch_size);
     }
 
-  network->validation_forward_result = create_forward_result (network);
+  // The queue must hold a job per sample
+  destroy_work_queue (network->work_queue);
+  network->work_queue = create_network_work_queue (network);
+}
 
-  network->mini_batch_backward_result = create_backward_result (network);
+// Split every mini-batch into micro-batches and stream them through the
+// layers, so different threads work on different layers at once. The
+// weights are still updated once per mini-batch.
+void
+network_enable_pipeline (Network *network, u32 micro_batch_size)
+{
+  assert (micro_batch_size > 0);
+  network->pipeline_micro_batch_size = micro_batch_size;
+}
 
-  network->work_queue = create_work_queue (mini_batch_size * 2, 3); // @Hardcode
+// Process the samples of a mini-batch one at a time and instead split the
+// products of every layer by output rows across the work queue. Helps
+// small mini-batches with wide layers, and evaluation.
+void
+network_enable_layer_split (Network *network)
+{
+  network->split_layers = true;
+}
 
-  return network;
+static void
+average_network_parameters (Network *network)
+{
+  PROFILE_BLOCK (PROFILE_PHASE_REDUCTION);
+  float scale = 1.f / collective_size (network->collective);
+  float *p = network->parameters.base;
+  allreduce_sum (network->collective, p, network->parameters.nmemb);
+  for (u32 k = 0; k < network->parameters.nmemb; ++k)
+    p[k] *= scale;
 }
 
 void
@@ -179,12 +769,28 @@ destroy_network (Network *network)
   clear_memory_pool (&network->mpool);
 }
 
-static int
-rand_cmp (const void *a, const void *b)
+static inline void
+swap_samples (float *a, float *b, u32 sample_size)
+{
+  float tmp[sample_size];
+  memcpy (tmp, a, sizeof (float) * sample_size);
+  memcpy (a, b, sizeof (float) * sample_size);
+  memcpy (b, tmp, sizeof (float) * sample_size);
+}
+
+// Fisher-Yates over whole samples
+static void
+shuffle_samples (Random *random, float *data, u32 count, u32 sample_size)
 {
-  (void) a;
-  (void) b;
-  return (rand () % 3) - 1;
+  PROFILE_BLOCK (PROFILE_PHASE_SHUFFLE);
+  for (u32 i = count; i > 1; --i)
+    {
+      u32 j = (u32) (random_u64 (random) % i);
+      if (j == i - 1)
+        continue;
+      swap_samples (data + ((u64) (i - 1) * sample_size),
+                    data + ((u64) j * sample_size), sample_size);
+    }
 }
 
 static inline float
@@ -213,6 +819,33 @@ sigmoid_prime (const float *input, const float *z, u32 nmemb, float *out)
     out[i] = input[i] * sigmoid_prime_ (z[i]);
 }
 
+// Inverted dropout fused with the activation. Fills `mask' four at a
+// time, it must have room for `nmemb' rounded up to 4. Unit `i' is kept
+// by draw `first' + `i' of the sequence `key'.
+static inline void
+sigmoid_dropout (const float *input, float *output, float *mask, u32 nmemb,
+                 float keep, u64 key, u32 first)
+{
+  __m128 keep4 = _mm_set1_ps (keep);
+  __m128 scale = _mm_set1_ps (1.f / keep);
+  for (u32 i = 0; i < nmemb; i += 4)
+    {
+      __m128 draw = random_unit_at_x4 (key, first + i);
+      __m128 kept = _mm_cmplt_ps (draw, keep4);
+      _mm_store_ps (mask + i, _mm_and_ps (kept, scale));
+    }
+  for (u32 i = 0; i < nmemb; ++i)
+    output[i] = sigmoid_ (input[i]) * mask[i];
+}
+
+static inline void
+sigmoid_prime_masked (const float *input, const float *z, const float *mask,
+                      u32 nmemb, float *out)
+{
+  for (u32 i = 0; i < nmemb; ++i)
+    out[i] = input[i] * sigmoid_prime_ (z[i]) * mask[i];
+}
+
 static inline void
 vec_sum (const float *a, const float *b, u32 nmemb, float *out)
 {
@@ -220,29 +853,89 @@ vec_sum (const float *a, const float *b, u32 nmemb, float *out)
     out[i] = a[i] + b[i];
 }
 
+static inline float
+horizontal_sum (__m128 v)
+{
+  v = _mm_hadd_ps (v, v);
+  v = _mm_hadd_ps (v, v);
+  return _mm_cvtss_f32 (v);
+}
+
+// The dense kernels below take `n' as a row stride that is a multiple of
+// NETWORK_SIMD_WIDTH, and all rows and vectors aligned to it, so they run
+// without tail loops or unaligned loads
+
 static inline void
 mat_nm_vec_m_product (const float *a, const float *b, u32 n, u32 m, float *out)
+{
+  assert ((n % NETWORK_SIMD_WIDTH) == 0);
+  for (u32 y = 0; y < m; ++y)
+    {
+      const float *row = a + (y * n);
+      __m128 sum0 = _mm_setzero_ps ();
+      __m128 sum1 = _mm_setzero_ps ();
+      for (u32 x = 0; x < n; x += 8)
+        {
+          sum0 = _mm_add_ps (sum0, _mm_mul_ps (_mm_load_ps (row + x),
+                                               _mm_load_ps (b + x)));
+          sum1 = _mm_add_ps (sum1, _mm_mul_ps (_mm_load_ps (row + x + 4),
+                                               _mm_load_ps (b + x + 4)));
+        }
+      out[y] = horizontal_sum (_mm_add_ps (sum0, sum1));
+    }
+}
+
+static inline void
+mat_nm_vec_m_sparse_product (const float *a, const float *b,
+                             const u32 *indices, u32 nindices,
+                             u32 n, u32 m, float *out)
 {
   for (u32 y = 0; y < m; ++y)
     {
       out[y] = 0;
-      for (u32 x = 0, offset = y * n; x < n; ++x)
-        out[y] += a[offset + x] * b[x];
+      for (u32 i = 0, offset = y * n; i < nindices; ++i)
+        {
+          u32 x = indices[i];
+          out[y] += a[offset + x] * b[x];
+        }
     }
 }
 
 static inline void
-mat_nm_vec_m_transpose_product (const float *a, const float *b, u32 n, u32 m,
-                                float *out)
+mat_nm_vec_m_transpose_product_range (const float *a, const float *b,
+                                      u32 n, u32 m, u32 begin, u32 end,
+                                      float *out)
 {
-  for (u32 x = 0; x < n; ++x)
+  assert ((begin % NETWORK_SIMD_WIDTH) == 0);
+  assert ((end % NETWORK_SIMD_WIDTH) == 0);
+
+  // Walk `a' row by row and accumulate into a tile of `out' that stays in
+  // L1, instead of striding down the columns
+  for (u32 x0 = begin; x0 < end; x0 += TRANSPOSE_TILE_WIDTH)
     {
-      out[x] = 0;
+      u32 x1 = MIN (x0 + TRANSPOSE_TILE_WIDTH, end);
+      for (u32 x = x0; x < x1; x += 4)
+        _mm_store_ps (out + x, _mm_setzero_ps ());
       for (u32 y = 0; y < m; ++y)
-        out[x] += a[(y * n) + x] * b[y];
+        {
+          const float *row = a + (y * n);
+          __m128 scale = _mm_set1_ps (b[y]);
+          for (u32 x = x0; x < x1; x += 4)
+            _mm_store_ps (out + x,
+                          _mm_add_ps (_mm_load_ps (out + x),
+                                      _mm_mul_ps (_mm_load_ps (row + x),
+                                                  scale)));
+        }
     }
 }
 
+static inline void
+mat_nm_vec_m_transpose_product (const float *a, const float *b, u32 n, u32 m,
+                                float *out)
+{
+  mat_nm_vec_m_transpose_product_range (a, b, n, m, 0, n, out);
+}
+
 static inline void
 mat_1n_mat_m1_product (const float *a, const float *b, u32 n, u32 m, float *out)
 {
@@ -253,56 +946,641 @@ mat_1n_mat_m1_product (const float *a, const float *b, u32 n, u32 m, float *out)
     }
 }
 
-static inline float
-network_cost (const float *a, const float *y, u32 nmemb)
+static inline void
+mat_kn_mat_km_product (const float **a, const float **b, u32 k, u32 n, u32 m,
+                       float *out)
 {
-  float sum = 0.f;
-  for (u32 i = 0; i < nmemb; ++i)
+  assert ((m % NETWORK_SIMD_WIDTH) == 0);
+
+  // Sum of k outer products a[i] * b[i]^T, one output row at a time so
+  // the row stays in cache for the whole batch
+  for (u32 y = 0; y < n; ++y)
     {
-      float v = (-y[i] * logf (a[i])) - ((1.f - y[i]) * logf (1.f - a[i]));
-      int isnan (float); // #include <math.h>
-      if (!isnan (v))
-        sum += v;
+      float *row = out + (y * m);
+      for (u32 x = 0; x < m; x += 4)
+        _mm_store_ps (row + x, _mm_setzero_ps ());
+      for (u32 i = 0; i < k; ++i)
+        {
+          __m128 scale = _mm_set1_ps (a[i][y]);
+          const float *bi = b[i];
+          for (u32 x = 0; x < m; x += 4)
+            _mm_store_ps (row + x,
+                          _mm_add_ps (_mm_load_ps (row + x),
+                                      _mm_mul_ps (_mm_load_ps (bi + x),
+                                                  scale)));
+        }
     }
-  return sum;
 }
 
 static inline void
-network_cost_derivative (const float *activations, const float *truth,
-                         const float *zs, u32 nmemb, float *output)
+mat_kn_mat_km_sparse_product (const float **a, const float **b,
+                              const u32 **indices, const u32 *nindices,
+                              u32 k, u32 n, u32 m, float *out)
 {
-  for (u32 i = 0; i < nmemb; ++i)
+  for (u32 y = 0; y < n; ++y)
+    {
+      float *row = out + (y * m);
+      memset (row, 0, sizeof (float) * m);
+      for (u32 i = 0; i < k; ++i)
+        {
+          float scale = a[i][y];
+          const float *bi = b[i];
+          const u32 *ii = indices[i];
+          for (u32 j = 0; j < nindices[i]; ++j)
+            {
+              u32 x = ii[j];
+              row[x] += scale * bi[x];
+            }
+        }
+    }
+}
+
+static inline u32
+gather_nonzero_indices (const float *v, u32 nmemb, u32 *indices)
+{
+  u32 count = 0;
+  for (u32 i = 0; i < nmemb; ++i)
+    {
+      indices[count] = i;
+      count += (v[i] != 0.f);
+    }
+  return count;
+}
+
+static inline float
+network_cost (const float *a, const float *y, u32 nmemb)
+{
+  float sum = 0.f;
+  for (u32 i = 0; i < nmemb; ++i)
+    {
+      float v = (-y[i] * logf (a[i])) - ((1.f - y[i]) * logf (1.f - a[i]));
+      int isnan (float); // #include <math.h>
+      if (!isnan (v))
+        sum += v;
+    }
+  return sum;
+}
+
+static inline void
+network_cost_derivative (const float *activations, const float *truth,
+                         const float *zs, u32 nmemb, float *output)
+{
+  for (u32 i = 0; i < nmemb; ++i)
     {
       (void) zs;
       output[i] = (activations[i] - truth[i]);// * sigmoid_prime_ (zs[i]);
     }
 }
 
+static inline bool
+uses_dropout (Network *network, ForwardResult *result, u32 i)
+{
+  return (result->training && network->dropout_keep < 1.f
+          && i < network->layers.nmemb - 1);
+}
+
+// Resample the image shifted and rotated about its center, nearest
+// neighbour, then add noise
+static void
+augment_input (Augmentation *augmentation, const float *input, u64 seed,
+               float *out)
+{
+  u32 w = augmentation->image_width;
+  u32 h = augmentation->image_height;
+  Random random;
+  seed_random (&random, seed);
+
+  float r[4];
+  _mm_storeu_ps (r, random_unit_x4 (&random));
+  float shift_range = (float) (2 * augmentation->max_shift + 1);
+  float dx = (float) (u32) (r[0] * shift_range) - augmentation->max_shift;
+  float dy = (float) (u32) (r[1] * shift_range) - augmentation->max_shift;
+  float angle = (2.f * r[2] - 1.f) * augmentation->max_rotation;
+  float c = cosf (angle);
+  float s = sinf (angle);
+  float cx = .5f * (w - 1);
+  float cy = .5f * (h - 1);
+
+  // Source coordinates are affine in x along every output row
+  __m128 lane = _mm_set_ps (3.f, 2.f, 1.f, 0.f);
+  __m128 step_x = _mm_mul_ps (lane, _mm_set1_ps (c));
+  __m128 step_y = _mm_mul_ps (lane, _mm_set1_ps (s));
+  __m128i width = _mm_set1_epi32 ((int) w);
+  __m128i height = _mm_set1_epi32 ((int) h);
+  __m128i minus_one = _mm_set1_epi32 (-1);
+  for (u32 y = 0; y < h; ++y)
+    {
+      float ry = y - cy - dy;
+      float rx = -cx - dx;
+      float base_x = (c * rx) + (s * ry) + cx;
+      float base_y = (c * ry) - (s * rx) + cy;
+      for (u32 x = 0; x < w; x += 4)
+        {
+          __m128 sx = _mm_add_ps (_mm_set1_ps (base_x + (c * x)), step_x);
+          __m128 sy = _mm_sub_ps (_mm_set1_ps (base_y - (s * x)), step_y);
+          __m128i ix = _mm_cvtps_epi32 (sx);
+          __m128i iy = _mm_cvtps_epi32 (sy);
+          __m128i inside = _mm_and_si128 (
+            _mm_and_si128 (_mm_cmpgt_epi32 (ix, minus_one),
+                           _mm_cmplt_epi32 (ix, width)),
+            _mm_and_si128 (_mm_cmpgt_epi32 (iy, minus_one),
+                           _mm_cmplt_epi32 (iy, height)));
+          __m128i index = _mm_add_epi32 (_mm_mullo_epi32 (iy, width), ix);
+          index = _mm_or_si128 (_mm_and_si128 (inside, index),
+                                _mm_andnot_si128 (inside, minus_one));
+          alignas (16) s32 indices[4];
+          _mm_store_si128 ((__m128i *) indices, index);
+          for (u32 j = 0; j < 4 && x + j < w; ++j)
+            out[(y * w) + x + j] = (indices[j] < 0) ? 0.f : input[indices[j]];
+        }
+    }
+
+  if (augmentation->noise <= 0.f)
+    return;
+
+  u32 size = w * h;
+  __m128 amplitude = _mm_set1_ps (2.f * augmentation->noise);
+  __m128 offset = _mm_set1_ps (augmentation->noise);
+  __m128 zero = _mm_setzero_ps ();
+  __m128 one = _mm_set1_ps (1.f);
+  for (u32 i = 0; i < size; i += 4)
+    {
+      __m128 noise = _mm_sub_ps (_mm_mul_ps (random_unit_x4 (&random),
+                                             amplitude), offset);
+      if (i + 4 <= size)
+        {
+          __m128 v = _mm_add_ps (_mm_loadu_ps (out + i), noise);
+          _mm_storeu_ps (out + i, _mm_min_ps (_mm_max_ps (v, zero), one));
+        }
+      else
+        {
+          float tail[4];
+          _mm_storeu_ps (tail, noise);
+          for (u32 j = 0; i + j < size; ++j)
+            out[i + j] = MIN (MAX (out[i + j] + tail[j], 0.f), 1.f);
+        }
+    }
+}
+
+static inline float *
+prepare_input (Network *network, float *input, ForwardResult *result)
+{
+  // Copy into the padded, aligned input buffer for the dense kernels,
+  // training samples are augmented on the way
+  u32 input_size = network->layers.base[0].width;
+  if (result->training && network->augmentation.image_width > 0)
+    augment_input (&network->augmentation, input, result->seed,
+                   result->input);
+  else
+    memcpy (result->input, input, sizeof (float) * input_size);
+  result->input_indices.nmemb = gather_nonzero_indices (result->input,
+                                                        input_size,
+                                                        result->input_indices.base);
+  result->sparse_input = (result->input_indices.nmemb
+                          < (u32) (SPARSE_INPUT_DENSITY * input_size));
+  return result->input;
+}
+
+static inline void
+feedforward_rows (Network *network, u32 i, float *input, ForwardResult *result,
+                  u32 begin, u32 end)
+{
+  NetworkLayer *nl = &network->layers.base[i];
+  ForwardResultLayer *rl = &result->layers.base[i];
+  assert (rl->height == nl->height);
+  assert (end <= nl->height);
+
+  const float *w = nl->weights + (begin * nl->stride);
+  u32 nrows = end - begin;
+  if (i == 0 && result->sparse_input)
+    mat_nm_vec_m_sparse_product (w, input,
+                                 result->input_indices.base,
+                                 result->input_indices.nmemb,
+                                 nl->stride, nrows, rl->zs + begin);
+  else
+    mat_nm_vec_m_product (w, input, nl->stride, nrows, rl->zs + begin);
+  vec_sum (rl->zs + begin, nl->biases + begin, nrows, rl->zs + begin);
+  if (uses_dropout (network, result, i))
+    {
+      // Drawn by row from a sequence per layer, so the masks don't
+      // depend on how the layer is sliced or which thread runs a slice
+      u64 state = result->seed + i;
+      sigmoid_dropout (rl->zs + begin, rl->activation + begin,
+                       rl->mask + begin, nrows, network->dropout_keep,
+                       splitmix64 (&state), begin);
+    }
+  else
+    {
+      sigmoid (rl->zs + begin, rl->activation + begin, nrows);
+    }
+}
+
+static inline void
+feedforward_layer (Network *network, u32 i, float *input, ForwardResult *result)
+{
+  if (i == 0)
+    input = prepare_input (network, input, result);
+  feedforward_rows (network, i, input, result, 0,
+                    network->layers.base[i].height);
+}
+
 static inline void
 feedforward (Network *network, float *input, ForwardResult *result)
 {
   assert (result->layers.nmemb == network->layers.nmemb);
   float *activation = input;
+  for (u32 i = 0; i < network->layers.nmemb; ++i)
+    {
+      feedforward_layer (network, i, activation, result);
+      activation = result->layers.base[i].activation;
+    }
+}
+
+static inline void
+backprop_rows (Network *network, u32 i, float *y,
+               ForwardResult *fr, BackwardResult *br, u32 begin, u32 end)
+{
+  u32 nlayers = network->layers.nmemb;
+  u32 nrows = end - begin;
+
+  // Weight gradients are left to `accumulate_mini_batch' which sums the
+  // outer products for the whole batch in one pass
+  if (i == nlayers - 1)
+    {
+      network_cost_derivative (fr->layers.base[i].activation + begin,
+                               y + begin,
+                               fr->layers.base[i].zs + begin,
+                               nrows,
+                               br->layers.base[i].delta_b + begin);
+    }
+  else
+    {
+      // The padded columns come out as zero
+      mat_nm_vec_m_transpose_product_range (network->layers.base[i + 1].weights,
+                                            br->layers.base[i + 1].delta_b,
+                                            network->layers.base[i + 1].stride,
+                                            network->layers.base[i + 1].height,
+                                            begin, SIMD_PADDED (end),
+                                            br->layers.base[i].delta_b);
+      if (uses_dropout (network, fr, i))
+        sigmoid_prime_masked (br->layers.base[i].delta_b + begin,
+                              fr->layers.base[i].zs + begin,
+                              fr->layers.base[i].mask + begin,
+                              nrows,
+                              br->layers.base[i].delta_b + begin);
+      else
+        sigmoid_prime (br->layers.base[i].delta_b + begin,
+                       fr->layers.base[i].zs + begin,
+                       nrows,
+                       br->layers.base[i].delta_b + begin);
+    }
+}
+
+static inline void
+backprop_layer (Network *network, u32 i, float *y,
+                ForwardResult *fr, BackwardResult *br)
+{
+  backprop_rows (network, i, y, fr, br, 0, network->layers.base[i].height);
+}
+
+static inline void
+backprop (Network *network, float *x, float *y,
+          ForwardResult *fr, BackwardResult *br)
+{
+  u32 nlayers = network->layers.nmemb;
+
+  assert (fr->layers.nmemb == nlayers);
+  assert (br->layers.nmemb == nlayers);
+
+  {
+    PROFILE_BLOCK (PROFILE_PHASE_FORWARD);
+    feedforward (network, x, fr);
+  }
+
+  PROFILE_BLOCK (PROFILE_PHASE_BACKWARD);
+  for (u32 i = nlayers - 1; i != (u32) -1; --i)
+    backprop_layer (network, i, y, fr, br);
+}
+
+static inline void
+do_backprop_work (void *user_data)
+{
+  MiniBatchResult *result = (MiniBatchResult *) user_data;
+  backprop (result->network,
+            result->input, result->output,
+            result->forward, result->backward);
+}
+
+static void
+do_pipeline_stage_work (void *user_data)
+{
+  PipelineWorker *worker = (PipelineWorker *) user_data;
+  Pipeline *pipeline = worker->pipeline;
+  Network *network = pipeline->network;
+  u32 s = worker->stage;
+  u32 nmicro = pipeline->nmicro;
+  bool backward = (s >= pipeline->nlayers);
+  u32 l = backward ? ((2 * pipeline->nlayers) - 1 - s) : s;
+
+  for (;;)
+    {
+      u32 m = __atomic_fetch_add (&pipeline->next[s], 1, __ATOMIC_RELAXED);
+      if (m >= nmicro)
+        break;
+      // The previous stage has all its jobs running already
+      if (s > 0)
+        {
+          while (!__atomic_load_n (&pipeline->done[((s - 1) * nmicro) + m],
+                                   __ATOMIC_ACQUIRE))
+            _mm_pause ();
+        }
+
+      {
+        PROFILE_BLOCK (backward
+                       ? PROFILE_PHASE_BACKWARD
+                       : PROFILE_PHASE_FORWARD);
+        u32 first = m * pipeline->micro_batch_size;
+        u32 end = MIN (first + pipeline->micro_batch_size,
+                       pipeline->mini_batch_size);
+        for (u32 i = first; i < end; ++i)
+          {
+            MiniBatchResult *result = &network->mini_batch_results.base[i];
+            if (backward)
+              {
+                backprop_layer (network, l, result->output,
+                                result->forward, result->backward);
+              }
+            else
+              {
+                ForwardResult *forward = result->forward;
+                float *input = ((l == 0)
+                                ? result->input
+                                : forward->layers.base[l - 1].activation);
+                feedforward_layer (network, l, input, forward);
+              }
+          }
+      }
+
+      __atomic_store_n (&pipeline->done[(s * nmicro) + m], 1,
+                        __ATOMIC_RELEASE);
+    }
+}
+
+// Every stage gets a group of jobs that take its micro-batches in order
+// and wait for the previous stage to finish each one, so different
+// threads work on different layers at once with no barrier until the end
+// of the mini-batch. The queue hands out jobs in the order they were
+// enqueued, stage by stage, so a job only ever waits on jobs that are
+// already running and this cannot deadlock even with fewer threads than
+// stages. It then degrades to running the stages one after another.
+static void
+run_pipeline (Network *network, u32 mini_batch_size)
+{
+  u32 nlayers = network->layers.nmemb;
+  u32 nstages = 2 * nlayers;
+  u32 micro_batch_size = network->pipeline_micro_batch_size;
+  u32 nmicro = (mini_batch_size + micro_batch_size - 1) / micro_batch_size;
+
+  // complete_all_work runs jobs on the calling thread as well
+  u32 group_size = MAX ((network->thread_count + 1) / nstages, 1u);
+  group_size = MIN (group_size, nmicro);
+
+  u32 next[nstages];
+  u32 done[nstages * nmicro];
+  memset (next, 0, sizeof (next));
+  memset (done, 0, sizeof (done));
+  Pipeline pipeline = {
+    .network          = network,
+    .nlayers          = nlayers,
+    .nmicro           = nmicro,
+    .micro_batch_size = micro_batch_size,
+    .mini_batch_size  = mini_batch_size,
+    .next             = next,
+    .done             = done
+  };
+
+  PipelineWorker workers[nstages * group_size];
+  for (u32 s = 0; s < nstages; ++s)
+    {
+      for (u32 g = 0; g < group_size; ++g)
+        {
+          PipelineWorker *worker = &workers[(s * group_size) + g];
+          worker->pipeline = &pipeline;
+          worker->stage = s;
+          enqueue_work (network->work_queue, do_pipeline_stage_work, worker);
+        }
+    }
+  complete_all_work (network->work_queue);
+}
+
+static void
+accumulate_layer_rows (MiniBatchResult *results, u32 mini_batch_size, u32 j,
+                       u32 begin, u32 end, BackwardResult *result)
+{
+  u32 k = mini_batch_size;
+  const float *deltas[k];
+  const float *activations[k];
+  const u32 *indices[k];
+  u32 nindices[k];
+
+  BackwardResultLayer *layer = &result->layers.base[j];
+  bool sparse = (j == 0);
+  for (u32 i = 0; i < k; ++i)
+    {
+      MiniBatchResult *mbr = &results[i];
+      deltas[i] = mbr->backward->layers.base[j].delta_b + begin;
+      if (j == 0)
+        {
+          activations[i] = mbr->forward->input;
+          indices[i] = mbr->forward->input_indices.base;
+          nindices[i] = mbr->forward->input_indices.nmemb;
+          sparse = sparse && mbr->forward->sparse_input;
+        }
+      else
+        {
+          activations[i] = mbr->forward->layers.base[j - 1].activation;
+        }
+    }
+
+  u32 nrows = end - begin;
+  float *delta_b = layer->delta_b + begin;
+  float *delta_w = layer->delta_w + (begin * layer->stride);
+  for (u32 y = 0; y < nrows; ++y)
+    {
+      delta_b[y] = 0.f;
+      for (u32 i = 0; i < k; ++i)
+        delta_b[y] += deltas[i][y];
+    }
+
+  if (sparse)
+    mat_kn_mat_km_sparse_product (deltas, activations, indices, nindices,
+                                  k, nrows, layer->stride, delta_w);
+  else
+    mat_kn_mat_km_product (deltas, activations, k, nrows, layer->stride,
+                           delta_w);
+}
+
+static void
+accumulate_mini_batch (MiniBatchResult *results, u32 mini_batch_size,
+                       BackwardResult *result)
+{
+  PROFILE_BLOCK (PROFILE_PHASE_REDUCTION);
+  for (u32 j = 0; j < result->layers.nmemb; ++j)
+    accumulate_layer_rows (results, mini_batch_size, j, 0,
+                           result->layers.base[j].height, result);
+}
+
+static void
+do_layer_slice_work (void *user_data)
+{
+  LayerSlice *slice = (LayerSlice *) user_data;
+  Network *network = slice->network;
+  static const ProfilePhase phases[] = {
+    [LAYER_SLICE_FORWARD]     = PROFILE_PHASE_FORWARD,
+    [LAYER_SLICE_BACKWARD]    = PROFILE_PHASE_BACKWARD,
+    [LAYER_SLICE_ACCUMULATE]  = PROFILE_PHASE_REDUCTION
+  };
+  PROFILE_BLOCK (phases[slice->kind]);
+  switch (slice->kind)
+    {
+    case LAYER_SLICE_FORWARD:
+      feedforward_rows (network, slice->layer, slice->input, slice->forward,
+                        slice->begin, slice->end);
+      break;
+    case LAYER_SLICE_BACKWARD:
+      backprop_rows (network, slice->layer, slice->y,
+                     slice->forward, slice->backward,
+                     slice->begin, slice->end);
+      break;
+    case LAYER_SLICE_ACCUMULATE:
+      accumulate_layer_rows (network->mini_batch_results.base,
+                             slice->mini_batch_size, slice->layer,
+                             slice->begin, slice->end, slice->backward);
+      break;
+    }
+}
+
+static inline u32
+layer_slice_count (Network *network, u32 nrows, u64 work)
+{
+  u64 count = work / LAYER_SLICE_MIN_WORK;
+  count = MIN (count, (u64) (network->thread_count + 1));
+  count = MIN (count, (u64) (SIMD_PADDED (nrows) / NETWORK_SIMD_WIDTH));
+  return MAX ((u32) count, 1u);
+}
+
+static void
+run_layer_slices (LayerSlice *proto, u32 nrows, u64 work)
+{
+  Network *network = proto->network;
+  u32 nslices = layer_slice_count (network, nrows, work);
+  if (nslices == 1)
+    {
+      proto->begin = 0;
+      proto->end = nrows;
+      do_layer_slice_work (proto);
+      return;
+    }
+
+  // Slices start on a SIMD boundary for the transpose product, rounding
+  // up can leave the last ones without rows
+  LayerSlice slices[nslices];
+  u32 rows_per_slice = SIMD_PADDED ((nrows + nslices - 1) / nslices);
+  for (u32 i = 0; i < nslices && i * rows_per_slice < nrows; ++i)
+    {
+      slices[i] = *proto;
+      slices[i].begin = i * rows_per_slice;
+      slices[i].end = MIN (slices[i].begin + rows_per_slice, nrows);
+      enqueue_work (network->work_queue, do_layer_slice_work, &slices[i]);
+    }
+  complete_all_work (network->work_queue);
+}
+
+// The split variants must only be called while the work queue is idle
+static void
+feedforward_split (Network *network, float *input, ForwardResult *result)
+{
+  float *activation = prepare_input (network, input, result);
   for (u32 i = 0; i < network->layers.nmemb; ++i)
     {
       NetworkLayer *nl = &network->layers.base[i];
-      float *b = nl->biases;
-      float *w = nl->weights;
-      ForwardResultLayer *rl = &result->layers.base[i];
-      assert (rl->height == nl->height);
-      mat_nm_vec_m_product (w, activation, nl->width, nl->height, rl->zs);
-      vec_sum (rl->zs, b, nl->height, rl->zs);
-      sigmoid (rl->zs, rl->activation, rl->height);
-      activation = rl->activation;
+      LayerSlice slice = {
+        .network = network,
+        .kind    = LAYER_SLICE_FORWARD,
+        .layer   = i,
+        .input   = activation,
+        .forward = result
+      };
+      run_layer_slices (&slice, nl->height, (u64) nl->width * nl->height);
+      activation = result->layers.base[i].activation;
     }
 }
 
+static void
+backprop_split (Network *network, float *x, float *y,
+                ForwardResult *fr, BackwardResult *br)
+{
+  u32 nlayers = network->layers.nmemb;
+
+  {
+    PROFILE_BLOCK (PROFILE_PHASE_FORWARD);
+    feedforward_split (network, x, fr);
+  }
+
+  PROFILE_BLOCK (PROFILE_PHASE_BACKWARD);
+  for (u32 i = nlayers - 1; i != (u32) -1; --i)
+    {
+      u64 work = network->layers.base[i].height;
+      if (i < nlayers - 1)
+        work = ((u64) network->layers.base[i + 1].width
+                * network->layers.base[i + 1].height);
+      LayerSlice slice = {
+        .network  = network,
+        .kind     = LAYER_SLICE_BACKWARD,
+        .layer    = i,
+        .y        = y,
+        .forward  = fr,
+        .backward = br
+      };
+      run_layer_slices (&slice, network->layers.base[i].height, work);
+    }
+}
+
+static void
+accumulate_mini_batch_split (Network *network, u32 mini_batch_size,
+                             BackwardResult *result)
+{
+  PROFILE_BLOCK (PROFILE_PHASE_REDUCTION);
+  for (u32 j = 0; j < result->layers.nmemb; ++j)
+    {
+      BackwardResultLayer *layer = &result->layers.base[j];
+      LayerSlice slice = {
+        .network         = network,
+        .kind            = LAYER_SLICE_ACCUMULATE,
+        .layer           = j,
+        .backward        = result,
+        .mini_batch_size = mini_batch_size
+      };
+      run_layer_slices (&slice, layer->height,
+                        (u64) mini_batch_size * layer->width * layer->height);
+    }
+}
+
+static inline void
+network_feedforward (Network *network, float *input, ForwardResult *result)
+{
+  if (network->split_layers)
+    feedforward_split (network, input, result);
+  else
+    feedforward (network, input, result);
+}
+
 static inline bool
 evaluate_network (Network *network, float *x, float *y)
 {
   ForwardResult *fr = network->validation_forward_result;
   assert (fr->layers.nmemb == network->layers.nmemb);
-  feedforward (network, x, fr);
+  network_feedforward (network, x, fr);
 
   ForwardResultLayer *last_layer = &fr->layers.base[fr->layers.nmemb - 1];
   float *activation = last_layer->activation;
@@ -345,7 +1623,7 @@ total_network_cost (Network *network, float *evaluation_data,
     {
       float *x = evaluation_data + (sample_size * k);
       float *y = x + input_size;
-      feedforward (network, x, fr);
+      network_feedforward (network, x, fr);
       float *a = fr->layers.base[fr->layers.nmemb - 1].activation;
       cost += network_cost (a, y, output_size) / evaluation_data_count;
     }
@@ -354,15 +1632,10 @@ total_network_cost (Network *network, float *evaluation_data,
   for (u32 i = 0; i < network->layers.nmemb; ++i)
     {
       NetworkLayer *layer = &network->layers.base[i];
+      u32 nweights = layer->stride * layer->height; // Padding is zero
       float norm = 0.f;
-      for (u32 y = 0; y < layer->height; ++y)
-        {
-          for (u32 x = 0, offset = y * layer->width; x < layer->width; ++x)
-            {
-              float w = ABS (layer->weights[offset + x]);
-              norm += w * w;
-            }
-        }
+      for (u32 k = 0; k < nweights; ++k)
+        norm += layer->weights[k] * layer->weights[k];
       norm = powf (norm, .5f);
       norm_sum += norm;
     }
@@ -372,61 +1645,131 @@ total_network_cost (Network *network, float *evaluation_data,
   return cost;
 }
 
+static void
+apply_gradient (Network *network, BackwardResult *gradient, u32 batch_size,
+                float eta, float lmbda, u32 n)
+{
+  PROFILE_BLOCK (PROFILE_PHASE_UPDATE);
+  float *p = network->parameters.base;
+  float *g = gradient->gradient;
+  float rate = eta / batch_size;
+  float decay = 1.f - (eta * (lmbda / n));
+  u32 nweights = network->parameters.nweights;
+
+  for (u32 k = 0; k < nweights; ++k)
+    p[k] = decay * (p[k] - (rate * g[k]));
+  for (u32 k = nweights; k < network->parameters.nmemb; ++k)
+    p[k] -= rate * g[k];
+}
+
+static inline float
+load_relaxed (float *p)
+{
+  float value;
+  __atomic_load (p, &value, __ATOMIC_RELAXED);
+  return value;
+}
+
 static inline void
-backprop (Network *network, float *x, float *y,
-          ForwardResult *fr, BackwardResult *br)
+store_relaxed (float *p, float value)
 {
-  u32 nlayers = network->layers.nmemb;
+  __atomic_store (p, &value, __ATOMIC_RELAXED);
+}
 
-  assert (fr->layers.nmemb == nlayers);
-  assert (br->layers.nmemb == nlayers);
+static void
+apply_gradient_relaxed (Network *network, BackwardResult *gradient,
+                        u32 batch_size, float eta, float lmbda, u32 n)
+{
+  // Same as `apply_gradient' but other workers may be reading or
+  // updating the same weights, a lost update is accepted
+  PROFILE_BLOCK (PROFILE_PHASE_UPDATE);
+  float *p = network->parameters.base;
+  float *g = gradient->gradient;
+  float rate = eta / batch_size;
+  float decay = 1.f - (eta * (lmbda / n));
+  u32 nweights = network->parameters.nweights;
+
+  for (u32 k = 0; k < nweights; ++k)
+    store_relaxed (&p[k], decay * (load_relaxed (&p[k]) - (rate * g[k])));
+  for (u32 k = nweights; k < network->parameters.nmemb; ++k)
+    store_relaxed (&p[k], load_relaxed (&p[k]) - (rate * g[k]));
+}
+
+static void
+do_async_sgd_work (void *user_data)
+{
+  AsyncWorker *worker = (AsyncWorker *) user_data;
+  AsyncEpoch *epoch = worker->epoch;
+  Network *network = worker->network;
+
+  u32 input_size = network->layers.base[0].width;
+  u32 output_size = network->layers.base[network->layers.nmemb - 1].height;
+  u32 sample_size = input_size + output_size;
 
-  feedforward (network, x, fr);
-
-  float *activations[nlayers + 1];
-  activations[0] = x;
-  for (u32 i = 0; i < nlayers; ++i)
-    activations[i + 1] = fr->layers.base[i].activation;
-
-  float *delta = br->layers.base[nlayers - 1].delta_b;
-  network_cost_derivative (activations[nlayers],
-                           y,
-                           fr->layers.base[nlayers - 1].zs,
-                           br->layers.base[nlayers - 1].height,
-                           delta);
-  mat_1n_mat_m1_product (delta,
-                         activations[nlayers - 1],
-                         br->layers.base[nlayers - 1].height,
-                         br->layers.base[nlayers - 1].width,
-                         br->layers.base[nlayers - 1].delta_w);
-
-  for (u32 i = nlayers - 2; i != (u32) -1; --i)
-    {
-      mat_nm_vec_m_transpose_product (network->layers.base[i + 1].weights,
-                                      delta,
-                                      network->layers.base[i + 1].width,
-                                      network->layers.base[i + 1].height,
-                                      br->layers.base[i].delta_b);
-      sigmoid_prime (br->layers.base[i].delta_b,
-                     fr->layers.base[i].zs,
-                     network->layers.base[i + 1].width,
-                     br->layers.base[i].delta_b);
-      delta = br->layers.base[i].delta_b;
-      mat_1n_mat_m1_product (delta,
-                             activations[i],
-                             br->layers.base[i].height,
-                             br->layers.base[i].width,
-                             br->layers.base[i].delta_w);
+  for (;;)
+    {
+      u32 mini_batch_size = MIN (__atomic_load_n (&network->mini_batch_size,
+                                                  __ATOMIC_RELAXED),
+                                 epoch->max_mini_batch_size);
+      u32 k = __sync_fetch_and_add (&epoch->next_sample, mini_batch_size);
+      if (k >= epoch->training_data_count)
+        break;
+
+      u32 actual_batch_size = MIN (mini_batch_size,
+                                   epoch->training_data_count - k);
+      float *mini_batch = epoch->training_data + (sample_size * k);
+      for (u32 i = 0; i < actual_batch_size; ++i)
+        {
+          MiniBatchResult *result = &worker->results[i];
+          result->input = mini_batch + (i * sample_size);
+          result->output = result->input + input_size;
+          result->forward->training = true;
+          result->forward->seed = random_u64 (&worker->random);
+          backprop (network, result->input, result->output,
+                    result->forward, result->backward);
+        }
+
+      accumulate_mini_batch (worker->results, actual_batch_size,
+                             worker->gradient);
+      apply_gradient_relaxed (network, worker->gradient, actual_batch_size,
+                              epoch->eta, epoch->lmbda,
+                              epoch->training_data_count);
+      __sync_fetch_and_add (&network->step_count, 1);
+
+      // One worker at a time, the copy races the others' updates the same
+      // way their reads do
+      WeightSnapshots *snapshots = network->weight_snapshots;
+      if (snapshots && weight_snapshot_taken (snapshots)
+          && !__sync_lock_test_and_set (&epoch->publishing, 1))
+        {
+          publish_weight_snapshot (network);
+          __sync_lock_release (&epoch->publishing);
+        }
     }
 }
 
-static inline void
-do_backprop_work (void *user_data)
+static void
+update_async_epoch (Network *network, float *training_data,
+                    u32 training_data_count, float eta, float lmbda)
 {
-  MiniBatchResult *result = (MiniBatchResult *) user_data;
-  backprop (result->network,
-            result->input, result->output,
-            result->forward, result->backward);
+  AsyncEpoch epoch = {
+    .training_data       = training_data,
+    .training_data_count = training_data_count,
+    .next_sample         = 0,
+    .eta                 = eta,
+    .lmbda               = lmbda
+  };
+
+  reserve_mini_batch_results (network, network->mini_batch_size);
+  epoch.max_mini_batch_size = network->mini_batch_results.nmemb;
+
+  for (u32 i = 0; i < network->async_workers.nmemb; ++i)
+    {
+      AsyncWorker *worker = &network->async_workers.base[i];
+      worker->epoch = &epoch;
+      enqueue_work (network->work_queue, do_async_sgd_work, worker);
+    }
+  complete_all_work (network->work_queue);
 }
 
 static void
@@ -437,15 +1780,7 @@ update_mini_batch (Network *network, float *mini_batch, u32 mini_batch_size,
   u32 output_size = network->layers.base[network->layers.nmemb - 1].height;
   u32 sample_size = input_size + output_size;
 
-  assert (mini_batch_size <= network->mini_batch_results.nmemb);
-
-  BackwardResult *result = network->mini_batch_backward_result;
-  for (u32 i = 0; i < result->layers.nmemb; ++i)
-    {
-      BackwardResultLayer *layer = &result->layers.base[i];
-      memset (layer->delta_b, 0, sizeof (float) * layer->height);
-      memset (layer->delta_w, 0, sizeof (float) * layer->width * layer->height);
-    }
+  reserve_mini_batch_results (network, mini_batch_size);
 
   for (u32 i = 0; i < mini_batch_size; ++i)
     {
@@ -455,102 +1790,307 @@ update_mini_batch (Network *network, float *mini_batch, u32 mini_batch_size,
       MiniBatchResult *result = &network->mini_batch_results.base[i];
       result->input = mini_batch + input_offset;
       result->output = mini_batch + output_offset;
-
-      /* do_backprop_work (result); */
-      enqueue_work (network->work_queue, do_backprop_work, result);
+      result->forward->training = true;
+      result->forward->seed = random_u64 (&network->random);
     }
-  complete_all_work (network->work_queue);
 
-  for (u32 i = 0; i < mini_batch_size; ++i)
+  if (network->pipeline_micro_batch_size > 0)
+    {
+      run_pipeline (network, mini_batch_size);
+    }
+  else if (network->split_layers)
     {
-      BackwardResult *delta = network->mini_batch_results.base[i].backward;
-      for (u32 j = 0; j < delta->layers.nmemb; ++j)
+      for (u32 i = 0; i < mini_batch_size; ++i)
         {
-          BackwardResultLayer *layer = &result->layers.base[j];
-          BackwardResultLayer *dlayer = &delta->layers.base[j];
-          u32 width = dlayer->width;
-          u32 height = dlayer->height;
-          for (u32 y = 0; y < height; ++y)
-            {
-              layer->delta_b[y] += dlayer->delta_b[y];
-              for (u32 x = 0, offset = y * width; x < width; ++x)
-                layer->delta_w[offset + x] += dlayer->delta_w[offset + x];
-            }
+          MiniBatchResult *result = &network->mini_batch_results.base[i];
+          backprop_split (network, result->input, result->output,
+                          result->forward, result->backward);
         }
     }
-
-  for (u32 i = 0; i < result->layers.nmemb; ++i)
+  else
     {
-      NetworkLayer *layer = &network->layers.base[i];
-      BackwardResultLayer *dlayer = &result->layers.base[i];
-      u32 width = layer->width;
-      u32 height = layer->height;
-      float *b = layer->biases;
-      float *w = layer->weights;
-      float *nb = dlayer->delta_b;
-      float *nw = dlayer->delta_w;
-      for (u32 y = 0; y < height; ++y)
+      for (u32 i = 0; i < mini_batch_size; ++i)
         {
-          b[y] -= ((eta / mini_batch_size) * nb[y]);
-
-          u32 offset = width * y;
-          for (u32 x = 0; x < width; ++x)
-            {
-              float tmp = w[offset + x] - ((eta / mini_batch_size) * nw[offset + x]);
-              w[offset + x] = (1.f - (eta * (lmbda / n))) * tmp;
-            }
+          MiniBatchResult *result = &network->mini_batch_results.base[i];
+          /* do_backprop_work (result); */
+          enqueue_work (network->work_queue, do_backprop_work, result);
         }
+      complete_all_work (network->work_queue);
     }
+
+  BackwardResult *result = network->mini_batch_backward_result;
+  if (network->split_layers)
+    accumulate_mini_batch_split (network, mini_batch_size, result);
+  else
+    accumulate_mini_batch (network->mini_batch_results.base, mini_batch_size,
+                           result);
+
+  u32 total_batch_size = mini_batch_size;
+  if (network->collective && network->collective_interval == 1)
+    {
+      PROFILE_BLOCK (PROFILE_PHASE_REDUCTION);
+      allreduce_sum (network->collective, result->gradient,
+                     network->parameters.nmemb);
+      total_batch_size *= collective_size (network->collective);
+    }
+
+  apply_gradient (network, result, total_batch_size, eta, lmbda, n);
+
+  ++network->step_count;
+  if (network->collective && network->collective_interval > 1
+      && (network->step_count % network->collective_interval) == 0)
+    average_network_parameters (network);
 }
 
-void
+// At most every TELEMETRY_INTERVAL unless forced
+static void
+network_publish_telemetry (Network *network, u64 samples, bool force)
+{
+  Telemetry *telemetry = network->telemetry;
+  if (!force && get_ticks () - telemetry->last_ticks < TELEMETRY_INTERVAL)
+    return;
+  sample_telemetry (telemetry, &network->mpool, network->work_queue, samples);
+  publish_telemetry (telemetry);
+}
+
+static float
+scheduled_eta (TrainingSchedule *schedule, float eta, float current_eta,
+               u32 epoch, u32 epochs)
+{
+  switch (schedule->kind)
+    {
+    case LEARNING_RATE_CONSTANT:
+      return eta;
+    case LEARNING_RATE_STEP:
+      return eta * powf (schedule->decay,
+                         (float) (epoch / schedule->step_epochs));
+    case LEARNING_RATE_COSINE:
+      return (schedule->min_eta
+              + (.5f * (eta - schedule->min_eta)
+                 * (1.f + cosf ((float) M_PI * epoch / epochs))));
+    case LEARNING_RATE_PLATEAU:
+      return current_eta; // Lowered in `network_sgd' as the cost stalls
+    }
+  return eta;
+}
+
+// Evaluation results are only filled in on rank 0 unless the schedule
+// depends on them
+TrainingStats
 network_sgd (Network *network, float *training_data, u32 training_data_count,
              u32 epochs, float eta, float lmbda)
 {
+  TrainingStats stats = {};
+
   u32 sample_size = (network->layers.base[0].width
                      + network->layers.base[network->layers.nmemb - 1].height);
 
   u32 evaluation_data_count = training_data_count / 60; // @Hardcode
   training_data_count -= evaluation_data_count;
+  stats.evaluation_count = evaluation_data_count;
   float *evaluation_data = training_data + (sample_size * training_data_count);
 
+  // Every process trains on its own equally sized shard so they all run
+  // the same number of mini-batches
+  u32 rank = 0;
+  u32 nranks = 1;
+  if (network->collective)
+    {
+      rank = collective_rank (network->collective);
+      nranks = collective_size (network->collective);
+    }
+  u32 shard_count = training_data_count / nranks;
+  float *shard = training_data + (sample_size * shard_count * rank);
+
+  // The count % nranks samples past the last shard would never be trained
+  // on. Every process has its own copy of the data, so rank r swaps the
+  // r:th of them into its shard before each shuffle and they take turns.
+  u32 remainder = training_data_count - (shard_count * nranks);
+  float *spare = NULL;
+  if (rank < remainder && shard_count > 0)
+    spare = training_data + (sample_size * ((shard_count * nranks) + rank));
+
+  TrainingSchedule *schedule = &network->schedule;
+  bool needs_cost = (schedule->kind == LEARNING_RATE_PLATEAU
+                     || schedule->patience > 0);
+  float current_eta = eta;
+  float best_cost = FLT_MAX;
+  u32 best_correct_count = 0;
+  u32 epochs_since_best = 0;
+  u32 epochs_since_decay = 0;
+
+  // Buffers for the largest step up front, growing them later would
+  // replace the workers in the middle of training
+  BatchStep *batch_steps = schedule->batch_steps;
+  u32 max_step_size = 0;
+  for (u32 i = 0; i < schedule->nbatch_steps; ++i)
+    max_step_size = MAX (max_step_size, batch_steps[i].mini_batch_size);
+  reserve_mini_batch_results (network, max_step_size);
+
+  Telemetry *telemetry = network->telemetry;
+  if (telemetry)
+    {
+      telemetry->current.epochs = epochs;
+      telemetry->current.epoch_sample_count = shard_count;
+      telemetry->current.done = false;
+    }
+
   for (u32 j = 0; j < epochs; ++j)
     {
-      qsort (training_data, training_data_count,
-             sizeof (training_data[0]) * sample_size, rand_cmp);
+      if (spare)
+        swap_samples (spare, shard + (sample_size * (shard_count - 1)),
+                      sample_size);
+      shuffle_samples (&network->random, shard, shard_count, sample_size);
+
+      current_eta = scheduled_eta (schedule, eta, current_eta, j, epochs);
+      for (u32 i = 0; i < schedule->nbatch_steps; ++i)
+        {
+          if (batch_steps[i].epoch == j)
+            network_set_mini_batch_size (network,
+                                         batch_steps[i].mini_batch_size);
+        }
+      if (telemetry)
+        {
+          telemetry->current.epoch = j;
+          telemetry->current.epoch_samples = 0;
+          telemetry->current.eta = current_eta;
+          network_publish_telemetry (network, stats.samples, true);
+        }
 
       u64 start_tick = get_ticks ();
-      u32 mini_batch_size = network->mini_batch_results.nmemb;
-      for (u32 k = 0; k < training_data_count; k += mini_batch_size)
+      if (network->async_workers.nmemb > 0)
         {
-          float *mini_batch = training_data + (sample_size * k);
-          u32 actual_batch_size = mini_batch_size;
-          if (k + mini_batch_size > training_data_count)
-            actual_batch_size = training_data_count - k;
-          update_mini_batch (network, mini_batch, actual_batch_size, eta, lmbda,
-                             training_data_count);
+          update_async_epoch (network, shard, shard_count, current_eta, lmbda);
         }
+      else
+        {
+          for (u32 k = 0, actual_batch_size; k < shard_count;
+               k += actual_batch_size)
+            {
+              // May be changed from another thread between mini-batches
+              u32 mini_batch_size = __atomic_load_n (&network->mini_batch_size,
+                                                     __ATOMIC_RELAXED);
+              float *mini_batch = shard + (sample_size * k);
+              actual_batch_size = mini_batch_size;
+              if (k + mini_batch_size > shard_count)
+                actual_batch_size = shard_count - k;
+              update_mini_batch (network, mini_batch, actual_batch_size,
+                                 current_eta, lmbda, training_data_count);
+              if (network->weight_snapshots
+                  && weight_snapshot_taken (network->weight_snapshots))
+                publish_weight_snapshot (network);
+              if (telemetry)
+                {
+                  u32 done = k + actual_batch_size;
+                  u64 samples = stats.samples + ((u64) done * nranks);
+                  telemetry->current.epoch_samples = done;
+                  network_publish_telemetry (network, samples, false);
+                }
+            }
+        }
+      if (network->collective && network->collective_interval > 1
+          && (network->step_count % network->collective_interval) != 0)
+        average_network_parameters (network);
       u64 end_tick = get_ticks ();
+      stats.epochs = j + 1;
+      stats.samples += (u64) shard_count * nranks;
+      stats.training_ticks += end_tick - start_tick;
+      if (network->weight_snapshots)
+        publish_weight_snapshot (network);
+      if (telemetry)
+        {
+          telemetry->current.epoch_samples = shard_count;
+          network_publish_telemetry (network, stats.samples, true);
+        }
+
+      // Every process sees the same parameters here, so if the schedule
+      // depends on the cost they all take the same decisions
+      if (rank != 0 && !needs_cost)
+        continue;
+
+      if (rank == 0)
+        printf ("epoch %u done in %.3fs\n", j,
+                (float) (end_tick - start_tick) / TICKS_PER_SECOND);
 
-      printf ("epoch %u done in %.3fs\n", j,
-              (float) (end_tick - start_tick) / TICKS_PER_SECOND);
+      // Too few samples to hold any back, nothing to measure the cost on
+      if (evaluation_data_count == 0)
+        continue;
 
       u32 correct_count = 0;
-      for (u32 k = 0; k < evaluation_data_count; ++k)
+      float cost;
+      {
+        PROFILE_BLOCK (PROFILE_PHASE_EVALUATION);
+        for (u32 k = 0; k < evaluation_data_count; ++k)
+          {
+            float *sample = evaluation_data + (sample_size * k);
+            if (evaluate_network (network, sample,
+                                  sample + network->layers.base[0].width))
+              ++correct_count;
+          }
+
+        cost = total_network_cost (network, evaluation_data,
+                                   evaluation_data_count, sample_size, lmbda);
+      }
+
+      if (rank == 0)
+        printf ("Accuracy on evaluation data: %u / %u, cost: %f\n",
+                correct_count, evaluation_data_count, cost);
+      stats.correct_count = correct_count;
+      stats.cost = cost;
+      if (telemetry && evaluation_data_count > 0)
+        {
+          add_telemetry_point (telemetry, cost,
+                               (float) correct_count / evaluation_data_count);
+          network_publish_telemetry (network, stats.samples, true);
+        }
+
+      if (cost < best_cost)
+        {
+          best_cost = cost;
+          best_correct_count = correct_count;
+          epochs_since_best = 0;
+          epochs_since_decay = 0;
+          if (network->best_parameters)
+            memcpy (network->best_parameters, network->parameters.base,
+                    sizeof (float) * network->parameters.nmemb);
+          continue;
+        }
+
+      ++epochs_since_best;
+      ++epochs_since_decay;
+      if (schedule->kind == LEARNING_RATE_PLATEAU
+          && epochs_since_decay >= schedule->plateau_patience)
         {
-          float *sample = evaluation_data + (sample_size * k);
-          if (evaluate_network (network, sample,
-                                sample + network->layers.base[0].width))
-            ++correct_count;
+          current_eta *= schedule->decay;
+          epochs_since_decay = 0;
         }
+      if (schedule->patience > 0 && epochs_since_best >= schedule->patience)
+        {
+          if (rank == 0)
+            printf ("Stopping after epoch %u, best cost: %f\n", j, best_cost);
+          break;
+        }
+    }
 
-      float cost = total_network_cost (network, evaluation_data,
-                                       evaluation_data_count,
-                                       sample_size, lmbda);
+  // The stats then describe the parameters that are kept
+  if (network->best_parameters && best_cost < FLT_MAX)
+    {
+      memcpy (network->parameters.base, network->best_parameters,
+              sizeof (float) * network->parameters.nmemb);
+      stats.correct_count = best_correct_count;
+      stats.cost = best_cost;
+    }
 
-      printf ("Accuracy on evaluation data: %u / %u, cost: %f\n",
-              correct_count, evaluation_data_count, cost);
+  if (network->weight_snapshots)
+    publish_weight_snapshot (network);
+  if (telemetry)
+    {
+      telemetry->current.done = true;
+      network_publish_telemetry (network, stats.samples, true);
     }
+
+  stats.best_cost = best_cost;
+  return stats;
 }
 
 #endif /* ! NETWORK_H */
@@ -29,6 +29,19 @@ typedef enum
 
 typedef struct _WorkQueue WorkQueue;
 typedef void (*WorkQueueCallback) (void *);
+typedef void (*ThreadExitCallback) (void);
+
+typedef struct _Collective Collective;
+
+// Hardware counters of the calling thread
+typedef enum
+{
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_LLC_MISSES,
+  COUNTER_DTLB_MISSES,
+  COUNTER_COUNT
+} Counter;
 
 typedef struct
 {
@@ -36,9 +49,20 @@ typedef struct
   void          (*deallocate_memory)    (MemoryBlock *);
   WorkQueue    *(*create_work_queue)    (u32, u32);
   void          (*destroy_work_queue)   (WorkQueue *);
-  void          (*enqueue_work)         (WorkQueue *, WorkQueueCallback, void *);
+  void          (*enqueue_work)         (WorkQueue *, WorkQueueCallback, void *,
+                                         const char *);
   void          (*complete_all_work)    (WorkQueue *);
+  u32           (*work_queue_busy_ticks) (WorkQueue *, u64 *, u32);
+  Collective   *(*create_collective)    (u32);
+  void          (*destroy_collective)   (Collective *);
+  u32           (*collective_rank)      (Collective *);
+  u32           (*collective_size)      (Collective *);
+  void          (*allreduce_sum)        (Collective *, float *, u32);
   u64           (*get_ticks)            (void);
+  void          (*begin_trace)          (void);
+  bool          (*end_trace)            (const char *);
+  bool          (*read_counters)        (u64 *);
+  void          (*set_thread_exit_callback) (ThreadExitCallback);
   struct
   {
     u32 width;
@@ -52,11 +76,35 @@ extern PlatformApi *g_platform;
   g_platform->create_work_queue ((entry_count), (thread_count))
 #define destroy_work_queue(queue) \
   g_platform->destroy_work_queue (queue)
+// The callback's name labels it in traces
 #define enqueue_work(queue, callback, data) \
-  g_platform->enqueue_work ((queue), (callback), (data))
+  g_platform->enqueue_work ((queue), (callback), (data), #callback)
 #define complete_all_work(queue) \
   g_platform->complete_all_work (queue)
+// Ticks each thread spent running jobs, the one calling
+// `complete_all_work' first, returns the number of threads
+#define work_queue_busy_ticks(queue, ticks, max_threads) \
+  g_platform->work_queue_busy_ticks ((queue), (ticks), (max_threads))
+#define create_collective(nranks) \
+  g_platform->create_collective (nranks)
+#define destroy_collective(collective) \
+  g_platform->destroy_collective (collective)
+#define collective_rank(collective) \
+  g_platform->collective_rank (collective)
+#define collective_size(collective) \
+  g_platform->collective_size (collective)
+#define allreduce_sum(collective, data, nmemb) \
+  g_platform->allreduce_sum ((collective), (data), (nmemb))
 #define get_ticks() \
   g_platform->get_ticks ()
+#define begin_trace() \
+  g_platform->begin_trace ()
+#define end_trace(path) \
+  g_platform->end_trace (path)
+#define read_counters(values) \
+  g_platform->read_counters (values)
+// Called on every work queue thread right before it exits
+#define set_thread_exit_callback(callback) \
+  g_platform->set_thread_exit_callback (callback)
 
 #endif /* ! PLATFORM_H */
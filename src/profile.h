@@ -0,0 +1,349 @@
+#ifndef PROFILE_H
+#define PROFILE_H 1
+
+// Per-phase timing. `PROFILE_BLOCK (phase)' times the rest of the scope
+// with rdtsc into a log2 histogram owned by the calling thread, so the
+// hot path never shares a cache line. `print_profile' sums the threads
+// and should only be called while the work queues are idle. A block
+// inside another on the same thread only counts as part of the outer one.
+//
+// Work queue threads give their histogram back when they exit, the next
+// new thread adds to it. Threads past PROFILE_MAX_THREADS live at once
+// are not counted, `print_profile' says how many.
+//
+// After `enable_profile_counters' every block also reads the hardware
+// counters of its thread, a syscall on each end so only for diagnosis.
+//
+// Build with -DPROFILE_MODE=0 to compile the blocks out.
+
+#include "types.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#ifndef PROFILE_MODE
+#define PROFILE_MODE 1
+#endif
+
+#define PROFILE_MAX_THREADS 256 // Live threads past this are not counted
+#define PROFILE_BUCKET_COUNT 40 // Bucket b counts [2^b, 2^(b+1)) cycles
+#define PROFILE_BAR_WIDTH 40
+
+typedef enum
+{
+  PROFILE_PHASE_LOAD,
+  PROFILE_PHASE_SHUFFLE,
+  PROFILE_PHASE_FORWARD,
+  PROFILE_PHASE_BACKWARD,
+  PROFILE_PHASE_REDUCTION,
+  PROFILE_PHASE_UPDATE,
+  PROFILE_PHASE_EVALUATION,
+  PROFILE_PHASE_UI_FRAME,
+  PROFILE_PHASE_COUNT
+} ProfilePhase;
+
+static const char *profile_phase_names[PROFILE_PHASE_COUNT] = {
+  [PROFILE_PHASE_LOAD]          = "load",
+  [PROFILE_PHASE_SHUFFLE]       = "shuffle",
+  [PROFILE_PHASE_FORWARD]       = "forward",
+  [PROFILE_PHASE_BACKWARD]      = "backward",
+  [PROFILE_PHASE_REDUCTION]     = "reduction",
+  [PROFILE_PHASE_UPDATE]        = "update",
+  [PROFILE_PHASE_EVALUATION]    = "evaluation",
+  [PROFILE_PHASE_UI_FRAME]      = "ui_frame"
+};
+
+typedef struct
+{
+  alignas (64) u64 counts[PROFILE_PHASE_COUNT][PROFILE_BUCKET_COUNT];
+  u64 cycles[PROFILE_PHASE_COUNT];
+  u64 max_cycles[PROFILE_PHASE_COUNT];
+  u64 counters[PROFILE_PHASE_COUNT][COUNTER_COUNT];
+  u64 counted[PROFILE_PHASE_COUNT]; // Blocks with counters
+  u32 depth; // Of open blocks
+} ProfileThread;
+
+typedef struct
+{
+  ProfileThread *thread;
+  ProfilePhase  phase;
+  u64           start;
+  bool          counted;
+  u64           counters[COUNTER_COUNT];
+} ProfileBlock;
+
+static ProfileThread g_profile_threads[PROFILE_MAX_THREADS];
+static volatile u32 g_profile_thread_count; // Slots ever claimed
+static u32 g_profile_free_threads[PROFILE_MAX_THREADS]; // Released slots
+static u32 g_profile_free_count;
+static volatile u32 g_profile_lock; // Of the free list and count
+static volatile u32 g_profile_dropped_count; // Threads without a slot
+static __thread ProfileThread *g_profile_thread;
+static __thread bool g_profile_dropped;
+static bool g_profile_counters;
+
+static void
+release_profile_thread ()
+{
+  ProfileThread *thread = g_profile_thread;
+  if (!thread)
+    return;
+  g_profile_thread = NULL;
+  while (__sync_lock_test_and_set (&g_profile_lock, 1))
+    _mm_pause ();
+  g_profile_free_threads[g_profile_free_count++]
+    = (u32) (thread - g_profile_threads);
+  __sync_lock_release (&g_profile_lock);
+}
+
+// NULL when every slot is taken
+static ProfileThread *
+claim_profile_thread ()
+{
+  ProfileThread *thread = NULL;
+  while (__sync_lock_test_and_set (&g_profile_lock, 1))
+    _mm_pause ();
+  if (g_profile_free_count > 0)
+    thread = &g_profile_threads[g_profile_free_threads[--g_profile_free_count]];
+  else if (g_profile_thread_count < PROFILE_MAX_THREADS)
+    thread = &g_profile_threads[__sync_fetch_and_add (&g_profile_thread_count,
+                                                      1)];
+  __sync_lock_release (&g_profile_lock);
+
+  if (thread)
+    set_thread_exit_callback (release_profile_thread);
+  else
+    __sync_fetch_and_add (&g_profile_dropped_count, 1);
+  return thread;
+}
+
+static inline ProfileThread *
+profile_thread ()
+{
+  if (!g_profile_thread && !g_profile_dropped)
+    {
+      g_profile_thread = claim_profile_thread ();
+      g_profile_dropped = !g_profile_thread;
+    }
+  return g_profile_thread;
+}
+
+static inline ProfileBlock
+begin_profile_block (ProfilePhase phase)
+{
+  ProfileBlock block = {.thread = profile_thread (), .phase = phase};
+  if (!block.thread)
+    return block;
+  if (block.thread->depth++ == 0 && g_profile_counters)
+    block.counted = read_counters (block.counters);
+  block.start = __rdtsc ();
+  return block;
+}
+
+static inline void
+end_profile_block (ProfileBlock *block)
+{
+  u64 cycles = __rdtsc () - block->start;
+  ProfileThread *thread = block->thread;
+  if (!thread || --thread->depth > 0)
+    return;
+
+  u32 bucket = 63 - __builtin_clzll (cycles | 1);
+  bucket = MIN (bucket, PROFILE_BUCKET_COUNT - 1u);
+
+  ++thread->counts[block->phase][bucket];
+  thread->cycles[block->phase] += cycles;
+  thread->max_cycles[block->phase] = MAX (thread->max_cycles[block->phase],
+                                          cycles);
+
+  u64 counters[COUNTER_COUNT];
+  if (block->counted && read_counters (counters))
+    {
+      for (u32 i = 0; i < COUNTER_COUNT; ++i)
+        thread->counters[block->phase][i] += counters[i] - block->counters[i];
+      ++thread->counted[block->phase];
+    }
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_ (a, b)
+
+#if PROFILE_MODE
+#define PROFILE_BLOCK(phase)                                            \
+  ProfileBlock PROFILE_CONCAT (profile_block_, __LINE__)                \
+  __attribute__ ((cleanup (end_profile_block))) = begin_profile_block (phase)
+#else
+#define PROFILE_BLOCK(phase) (void) (phase)
+#endif
+
+void
+reset_profile ()
+{
+  memset (g_profile_threads, 0,
+          sizeof (g_profile_threads[0]) * g_profile_thread_count);
+  g_profile_dropped_count = 0;
+}
+
+// Totals so far for live views. Other threads may be adding to them, a
+// sum can be a block behind but every single count is a whole u64.
+static void
+sum_profile_phases (u64 *cycles)
+{
+  memset (cycles, 0, sizeof (u64) * PROFILE_PHASE_COUNT);
+  u32 nthreads = g_profile_thread_count;
+  for (u32 t = 0; t < nthreads; ++t)
+    {
+      for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+        cycles[p] += __atomic_load_n (&g_profile_threads[t].cycles[p],
+                                      __ATOMIC_RELAXED);
+    }
+}
+
+// False when the hardware counters are not available to this process
+bool
+enable_profile_counters ()
+{
+  u64 counters[COUNTER_COUNT];
+  g_profile_counters = read_counters (counters);
+  return g_profile_counters;
+}
+
+// Assumes an invariant TSC, which every x86 since Nehalem has
+static double
+measure_cycles_per_second ()
+{
+  u64 start_tick = get_ticks ();
+  u64 start_cycle = __rdtsc ();
+  u64 end_tick;
+  do
+    end_tick = get_ticks ();
+  while (end_tick - start_tick < TICKS_PER_SECOND / 50);
+  u64 end_cycle = __rdtsc ();
+  return ((double) (end_cycle - start_cycle) * TICKS_PER_SECOND
+          / (end_tick - start_tick));
+}
+
+// Upper bound of the bucket holding the given fraction of the samples,
+// clamped to the slowest sample
+static u64
+profile_percentile_cycles (u64 *counts, u64 total, u64 max, double fraction)
+{
+  u64 target = (u64) (fraction * total);
+  u64 seen = 0;
+  for (u32 b = 0; b < PROFILE_BUCKET_COUNT; ++b)
+    {
+      seen += counts[b];
+      if (seen > target)
+        return MIN (2ull << b, max);
+    }
+  return max;
+}
+
+// A table of all phases that ran, then a histogram of each
+void
+print_profile (FILE *out)
+{
+  u64 counts[PROFILE_PHASE_COUNT][PROFILE_BUCKET_COUNT] = {};
+  u64 cycles[PROFILE_PHASE_COUNT] = {};
+  u64 max_cycles[PROFILE_PHASE_COUNT] = {};
+  u64 totals[PROFILE_PHASE_COUNT] = {};
+  u64 counters[PROFILE_PHASE_COUNT][COUNTER_COUNT] = {};
+  u64 counted[PROFILE_PHASE_COUNT] = {};
+
+  u32 nthreads = g_profile_thread_count;
+  for (u32 t = 0; t < nthreads; ++t)
+    {
+      ProfileThread *thread = &g_profile_threads[t];
+      for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+        {
+          for (u32 b = 0; b < PROFILE_BUCKET_COUNT; ++b)
+            {
+              counts[p][b] += thread->counts[p][b];
+              totals[p] += thread->counts[p][b];
+            }
+          cycles[p] += thread->cycles[p];
+          max_cycles[p] = MAX (max_cycles[p], thread->max_cycles[p]);
+          for (u32 i = 0; i < COUNTER_COUNT; ++i)
+            counters[p][i] += thread->counters[p][i];
+          counted[p] += thread->counted[p];
+        }
+    }
+
+  double us_per_cycle = 1e6 / measure_cycles_per_second ();
+
+  fprintf (out, "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "phase",
+           "count", "total_s", "mean_us", "p50_us", "p90_us", "p99_us",
+           "max_us");
+  for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+    {
+      if (totals[p] == 0)
+        continue;
+      u64 p50 = profile_percentile_cycles (counts[p], totals[p],
+                                           max_cycles[p], .5);
+      u64 p90 = profile_percentile_cycles (counts[p], totals[p],
+                                           max_cycles[p], .9);
+      u64 p99 = profile_percentile_cycles (counts[p], totals[p],
+                                           max_cycles[p], .99);
+      fprintf (out, "%-10s %10" PRIu64 " %10.3f %10.2f %10.2f %10.2f %10.2f "
+               "%10.2f\n",
+               profile_phase_names[p], totals[p],
+               cycles[p] * us_per_cycle * 1e-6,
+               cycles[p] * us_per_cycle / totals[p],
+               p50 * us_per_cycle, p90 * us_per_cycle, p99 * us_per_cycle,
+               max_cycles[p] * us_per_cycle);
+    }
+  if (g_profile_dropped_count > 0)
+    fprintf (out, "(%u threads past %u at once were not counted)\n",
+             g_profile_dropped_count, PROFILE_MAX_THREADS);
+
+  if (g_profile_counters)
+    {
+      fprintf (out, "\n%-10s %12s %12s %6s %12s %12s %8s\n", "phase",
+               "cycles", "instructions", "ipc", "llc_misses", "dtlb_misses",
+               "llc_mpki");
+      for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+        {
+          if (counted[p] == 0)
+            continue;
+          // Means per block
+          double n = (double) counted[p];
+          double instructions = counters[p][COUNTER_INSTRUCTIONS];
+          fprintf (out, "%-10s %12.0f %12.0f %6.2f %12.1f %12.1f %8.2f\n",
+                   profile_phase_names[p],
+                   counters[p][COUNTER_CYCLES] / n,
+                   instructions / n,
+                   instructions / MAX (counters[p][COUNTER_CYCLES], 1ull),
+                   counters[p][COUNTER_LLC_MISSES] / n,
+                   counters[p][COUNTER_DTLB_MISSES] / n,
+                   1000. * counters[p][COUNTER_LLC_MISSES]
+                   / MAX (instructions, 1.));
+        }
+    }
+
+  for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+    {
+      if (totals[p] == 0)
+        continue;
+      u64 peak = 0;
+      for (u32 b = 0; b < PROFILE_BUCKET_COUNT; ++b)
+        peak = MAX (peak, counts[p][b]);
+
+      fprintf (out, "\n%s\n", profile_phase_names[p]);
+      for (u32 b = 0; b < PROFILE_BUCKET_COUNT; ++b)
+        {
+          if (counts[p][b] == 0)
+            continue;
+          char bar[PROFILE_BAR_WIDTH + 1];
+          u32 width = (u32) ((counts[p][b] * PROFILE_BAR_WIDTH + peak - 1) / peak);
+          memset (bar, '#', width);
+          bar[width] = '\0';
+          fprintf (out, "  < %12.2f us %10" PRIu64 " %s\n",
+                   (2ull << b) * us_per_cycle, counts[p][b], bar);
+        }
+    }
+  fflush (out);
+}
+
+#endif /* ! PROFILE_H */
@@ -0,0 +1,167 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H 1
+
+// Training progress for the UI. The trainer fills in its own snapshot
+// and publishes a copy through a seqlock, so it never waits on a reader.
+// Readers copy the published snapshot and retry if a publish got in
+// between, after a few tries they keep what they had.
+
+#include "types.h"
+#include "platform.h"
+#include "memory.h"
+#include "profile.h"
+
+#include <string.h>
+
+#define TELEMETRY_MAX_EPOCHS 256 // Points on the curves, older are dropped
+#define TELEMETRY_MAX_THREADS 16
+#define TELEMETRY_INTERVAL (TICKS_PER_SECOND / 20) // Between publishes
+#define TELEMETRY_READ_TRIES 4
+
+typedef struct
+{
+  u32       epoch; // From 0
+  u32       epochs;
+  u32       epoch_samples; // Done in the current epoch, by this process
+  u32       epoch_sample_count;
+  u64       samples; // Since training started, by all processes
+  float     samples_per_second; // Over the last interval
+  float     eta;
+  float     phase_seconds[PROFILE_PHASE_COUNT]; // Sums over all threads
+  u32       nthreads; // Of the work queue, its caller first
+  float     utilization[TELEMETRY_MAX_THREADS]; // Over the last interval
+  u64       pool_size;
+  u64       pool_used;
+  u32       npoints;
+  float     cost[TELEMETRY_MAX_EPOCHS]; // After each epoch
+  float     accuracy[TELEMETRY_MAX_EPOCHS];
+  bool      done;
+} TelemetrySnapshot;
+
+typedef struct
+{
+  volatile u32      sequence; // Odd while a publish is under way
+  TelemetrySnapshot published;
+
+  // Only touched by the trainer
+  alignas (64) TelemetrySnapshot current;
+  u64               first_ticks;
+  u64               first_tsc;
+  u64               last_ticks;
+  u64               last_samples;
+  u64               last_samples_ticks;
+  WorkQueue        *last_queue; // Of `last_busy', rebuilt queues start over
+  u64               last_busy[TELEMETRY_MAX_THREADS];
+} Telemetry;
+
+static void
+publish_telemetry (Telemetry *telemetry)
+{
+  u32 sequence = telemetry->sequence;
+  __atomic_store_n (&telemetry->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  memcpy (&telemetry->published, &telemetry->current,
+          sizeof (telemetry->published));
+  __atomic_store_n (&telemetry->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// False if every try raced a publish, `snapshot' is then left untouched
+bool
+read_telemetry (Telemetry *telemetry, TelemetrySnapshot *snapshot)
+{
+  TelemetrySnapshot copy;
+  for (u32 i = 0; i < TELEMETRY_READ_TRIES; ++i)
+    {
+      u32 before = __atomic_load_n (&telemetry->sequence, __ATOMIC_ACQUIRE);
+      if (before & 1)
+        continue;
+      memcpy (&copy, &telemetry->published, sizeof (copy));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      u32 after = __atomic_load_n (&telemetry->sequence, __ATOMIC_RELAXED);
+      if (before == after)
+        {
+          memcpy (snapshot, &copy, sizeof (copy));
+          return true;
+        }
+    }
+  return false;
+}
+
+// Rates are over the time since the last call, samples per second since
+// the last call that had new samples
+static void
+sample_telemetry (Telemetry *telemetry, MemoryPool *pool, WorkQueue *queue,
+                  u64 samples)
+{
+  TelemetrySnapshot *current = &telemetry->current;
+  u64 ticks = get_ticks ();
+  u64 tsc = __rdtsc ();
+  if (telemetry->first_ticks == 0)
+    {
+      telemetry->first_ticks = telemetry->last_ticks = ticks;
+      telemetry->first_tsc = tsc;
+      telemetry->last_samples_ticks = ticks;
+    }
+
+  current->samples = samples;
+  if (samples != telemetry->last_samples
+      && ticks > telemetry->last_samples_ticks)
+    {
+      current->samples_per_second = ((double) TICKS_PER_SECOND
+                                     * (samples - telemetry->last_samples)
+                                     / (ticks - telemetry->last_samples_ticks));
+      telemetry->last_samples = samples;
+      telemetry->last_samples_ticks = ticks;
+    }
+
+  // Profile cycles to seconds through the TSC rate seen so far
+  double seconds_per_cycle = 0.;
+  if (tsc > telemetry->first_tsc)
+    seconds_per_cycle = ((double) (ticks - telemetry->first_ticks)
+                         / TICKS_PER_SECOND / (tsc - telemetry->first_tsc));
+  u64 phase_cycles[PROFILE_PHASE_COUNT];
+  sum_profile_phases (phase_cycles);
+  for (u32 p = 0; p < PROFILE_PHASE_COUNT; ++p)
+    current->phase_seconds[p] = phase_cycles[p] * seconds_per_cycle;
+
+  u64 busy[TELEMETRY_MAX_THREADS];
+  u64 elapsed = ticks - telemetry->last_ticks;
+  if (queue != telemetry->last_queue)
+    {
+      memset (telemetry->last_busy, 0, sizeof (telemetry->last_busy));
+      telemetry->last_queue = queue;
+    }
+  current->nthreads = work_queue_busy_ticks (queue, busy,
+                                             TELEMETRY_MAX_THREADS);
+  for (u32 i = 0; i < current->nthreads; ++i)
+    {
+      u64 delta = busy[i] - MIN (telemetry->last_busy[i], busy[i]);
+      current->utilization[i] = 0.f;
+      if (elapsed > 0)
+        current->utilization[i] = MIN ((float) delta / elapsed, 1.f);
+      telemetry->last_busy[i] = busy[i];
+    }
+
+  get_memory_pool_usage (pool, &current->pool_size, &current->pool_used);
+
+  telemetry->last_ticks = ticks;
+}
+
+static void
+add_telemetry_point (Telemetry *telemetry, float cost, float accuracy)
+{
+  TelemetrySnapshot *current = &telemetry->current;
+  if (current->npoints == TELEMETRY_MAX_EPOCHS)
+    {
+      memmove (current->cost, current->cost + 1,
+               sizeof (float) * (TELEMETRY_MAX_EPOCHS - 1));
+      memmove (current->accuracy, current->accuracy + 1,
+               sizeof (float) * (TELEMETRY_MAX_EPOCHS - 1));
+      --current->npoints;
+    }
+  current->cost[current->npoints] = cost;
+  current->accuracy[current->npoints] = accuracy;
+  ++current->npoints;
+}
+
+#endif /* ! TELEMETRY_H */
@@ -0,0 +1,204 @@
+#ifndef TRAINING_H
+#define TRAINING_H 1
+
+#include "memory.h"
+#include "maths.h"
+#include "network.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+static u32
+fread_u32 (FILE *f)
+{
+  u32 result;
+  size_t nread;
+  nread = fread (&result, sizeof (result), 1, f);
+  if (nread != 1)
+    return (u32) -1;
+  result = (((result & 0x000000FF) << 24) |
+            ((result & 0x0000FF00) <<  8) |
+            ((result & 0x00FF0000) >>  8) |
+            ((result & 0xFF000000) >> 24));
+  return result;
+}
+
+// Load the IDX images and labels in `config', exits on malformed files
+float *
+load_training_data (MemoryPool *pool, AppConfig *config, u32 *count)
+{
+  PROFILE_BLOCK (PROFILE_PHASE_LOAD);
+  FILE *images_fh = fopen (config->images_path, "r");
+  FILE *labels_fh = fopen (config->labels_path, "r");
+  if (!images_fh || !labels_fh)
+    {
+      fprintf (stderr, "cannot open %s and %s\n", config->images_path,
+               config->labels_path);
+      exit (EXIT_FAILURE);
+    }
+
+  u32 magic;
+  magic = fread_u32 (images_fh);
+  assert (magic == 2051);
+  magic = fread_u32 (labels_fh);
+  assert (magic == 2049);
+
+  u32 num_images = fread_u32 (images_fh);
+  u32 num_rows = fread_u32 (images_fh);
+  u32 num_cols = fread_u32 (images_fh);
+  u32 num_labels = fread_u32 (labels_fh);
+  printf ("num_images: %u\n", num_images);
+  printf ("num_rows: %u\n", num_rows);
+  printf ("num_cols: %u\n", num_cols);
+  printf ("num_labels: %u\n", num_labels);
+
+  assert (num_labels == num_images);
+  if (num_rows * num_cols != config->sizes[0]
+      || config->sizes[config->nsizes - 1] != 10)
+    {
+      fprintf (stderr, "sizes do not fit %ux%u images and 10 labels\n",
+               num_rows, num_cols);
+      fclose (images_fh);
+      fclose (labels_fh);
+      exit (EXIT_FAILURE);
+    }
+
+  /* srand (time (NULL)); */
+
+  u32 images_buffer_size = ((num_rows * num_cols) + 10) * num_images; // +10 for labels
+  float *images_buffer = push_array (pool, float, images_buffer_size,
+                                     MEMORY_FLAG_NONE);
+  for (u32 i = 0, j = 0; i < num_images; ++i)
+    {
+      size_t nread;
+      u8 buffer[num_cols * num_rows];
+      nread = fread (buffer, sizeof (buffer[0]), num_cols * num_rows, images_fh);
+      if (nread != sizeof (buffer[0]) * num_cols * num_rows)
+        {
+          fprintf (stderr, "nread = %lu (of %u)\n", nread, num_cols * num_rows);
+          fclose (images_fh);
+          fclose (labels_fh);
+          exit (EXIT_FAILURE);
+        }
+      for (u32 k = 0; k < sizeof (buffer) / sizeof (buffer[0]); ++k, ++j)
+        images_buffer[j] = ((float) buffer[k]) / 255.f;
+
+      u8 label = (u8) -1;
+      (void) fread (&label, sizeof (label), 1, labels_fh);
+      if (label >= 10)
+        {
+          fprintf (stderr, "label = %u\n", label);
+          fclose (images_fh);
+          fclose (labels_fh);
+          exit (EXIT_FAILURE);
+        }
+
+      for (u8 k = 0; k < 10; ++k, ++j)
+        images_buffer[j] = (k == label) ? 1.f : 0.f;
+    }
+
+  fclose (images_fh);
+  fclose (labels_fh);
+
+  *count = num_images;
+  return images_buffer;
+}
+
+Network *
+create_configured_network (AppConfig *config)
+{
+  Network *network = create_network (config->sizes, config->nsizes,
+                                     config->mini_batch_size);
+  if (config->thread_count - 1 != network->thread_count)
+    network_set_thread_count (network, config->thread_count - 1);
+  if (config->seed != 0)
+    network_enable_deterministic (network, config->seed);
+  if (config->async_sgd)
+    network_enable_async (network);
+  if (config->pipeline_micro_batch_size > 0)
+    network_enable_pipeline (network, config->pipeline_micro_batch_size);
+  if (config->split_layers)
+    network_enable_layer_split (network);
+  network_set_schedule (network, config->schedule);
+  if (config->dropout_rate > 0.f)
+    network_enable_dropout (network, config->dropout_rate);
+  if (augmentation_enabled (&config->augmentation))
+    network_enable_augmentation (network, config->augmentation);
+  return network;
+}
+
+// Forked trainer processes exit in here, only the first process returns
+TrainingStats
+run_training (Network *network, AppConfig *config, float *data, u32 count)
+{
+  Collective *collective = NULL;
+  if (config->trainer_count > 1)
+    {
+      collective = create_collective (config->trainer_count);
+      network_attach_collective (network, collective, config->sync_interval);
+    }
+
+  bool tracing = (config->trace_path[0] != '\0');
+  if (tracing)
+    begin_trace ();
+
+  TrainingStats stats = network_sgd (network, data, count, config->epochs,
+                                     config->eta, config->lmbda);
+
+  if (tracing)
+    {
+      char path[CONFIG_MAX_PATH + 16];
+      u32 rank = collective ? collective_rank (collective) : 0;
+      if (rank == 0)
+        snprintf (path, sizeof (path), "%s", config->trace_path);
+      else
+        snprintf (path, sizeof (path), "%s.%u", config->trace_path, rank);
+      if (!end_trace (path))
+        fprintf (stderr, "cannot write trace to %s\n", path);
+    }
+
+  if (collective)
+    {
+      bool is_trainer_process = (collective_rank (collective) != 0);
+      destroy_collective (collective);
+      if (is_trainer_process)
+        {
+          // Skips the atexit handlers of whatever forked us, the app's
+          // included. Its buffers were flushed before the fork.
+          fflush (stdout);
+          fflush (stderr);
+          _exit (EXIT_SUCCESS);
+        }
+    }
+
+  return stats;
+}
+
+// One line of JSON, the evaluation results are null without evaluation data
+void
+print_training_summary (FILE *out, AppConfig *config, TrainingStats *stats)
+{
+  double seconds = (double) stats->training_ticks / TICKS_PER_SECOND;
+
+  fprintf (out, "{\"sizes\": [");
+  for (u32 i = 0; i < config->nsizes; ++i)
+    fprintf (out, "%s%u", (i > 0) ? ", " : "", config->sizes[i]);
+  fprintf (out, "], \"mini_batch_size\": %u, \"threads\": %u, "
+           "\"trainers\": %u, \"epochs\": %u, \"samples\": %" PRIu64 ", "
+           "\"training_seconds\": %.6f, \"samples_per_second\": %.1f, ",
+           config->mini_batch_size, config->thread_count,
+           config->trainer_count, stats->epochs, stats->samples, seconds,
+           (seconds > 0.) ? stats->samples / seconds : 0.);
+  if (stats->evaluation_count > 0)
+    fprintf (out, "\"accuracy\": %.6f, \"cost\": %.6f, "
+             "\"best_cost\": %.6f}\n",
+             (double) stats->correct_count / stats->evaluation_count,
+             stats->cost, stats->best_cost);
+  else
+    fprintf (out, "\"accuracy\": null, \"cost\": null, "
+             "\"best_cost\": null}\n");
+  fflush (out);
+}
+
+#endif /* ! TRAINING_H */